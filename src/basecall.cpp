@@ -28,6 +28,7 @@ SOFTWARE.
 
 ******************************************************************************/
 
+#include <algorithm>
 #include <cstdint>
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,22 +37,32 @@ SOFTWARE.
 #include "basecall.h"
 #include "error.h"
 
-void basecall_chunks(
-    std::vector<torch::Tensor> tensors,
+void basecall_submit(
     std::vector<Chunk *> chunks,
-    int chunk_size,
+    std::vector<const read_signal_t *> signals,
     ModelRunnerBase &model_runner,
     timestamps_t *ts
 ) {
-    for (size_t i = 0; i < tensors.size(); ++i) {
-        ts->time_accept -= realtime();
-        model_runner.accept_chunk(i, tensors[i]);
-        ts->time_accept += realtime();
+    ts->time_accept -= realtime();
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        model_runner.accept_chunk(i, *signals[i], chunks[i]->input_offset);
     }
+    ts->time_accept += realtime();
 
-    LOG_DEBUG("%s", "decoding chunks");
+    LOG_DEBUG("%s", "submitting chunks");
     ts->time_decode -= realtime();
-    std::vector<DecodedChunk> decoded_chunks = model_runner.call_chunks(chunks.size());
+    model_runner.submit_chunks(chunks.size());
+    ts->time_decode += realtime();
+}
+
+void basecall_collect(
+    std::vector<Chunk *> chunks,
+    ModelRunnerBase &model_runner,
+    timestamps_t *ts
+) {
+    LOG_DEBUG("%s", "collecting chunks");
+    ts->time_decode -= realtime();
+    std::vector<DecodedChunk> decoded_chunks = model_runner.collect_chunks();
     ts->time_decode += realtime();
 
     for (size_t i = 0; i < chunks.size(); ++i) {
@@ -61,48 +72,64 @@ void basecall_chunks(
     }
 }
 
+/* hand out the next portion of the queue: gpu_batch_size chunks, or tail_portion in its last wave */
+static bool claim_chunks(chunk_queue_t* queue, int64_t batch, int64_t *start, int64_t *end) {
+    int64_t n_chunks = queue->chunks.size();
+    for (;;) {
+        int64_t next = __atomic_load_n(&queue->next, __ATOMIC_ACQUIRE);
+        if (next >= n_chunks) {
+            return false;
+        }
+        int64_t portion = next < queue->tail_start ? std::min(batch, queue->tail_start - next) : queue->tail_portion;
+        if (__sync_bool_compare_and_swap(&queue->next, next, next + portion)) {
+            *start = next;
+            *end = std::min(next + portion, n_chunks);
+            return true;
+        }
+    }
+}
+
 void basecall_thread(
     core_t* core,
-    db_t* db,
-    size_t runner_idx,
-    size_t start,
-    size_t end
+    std::vector<chunk_queue_t>* queues,
+    size_t runner_idx
 ) {
     opt_t opt = core->opt;
     timestamps_t *ts = (*core->runner_ts)[runner_idx];
 
     auto& model_runner = *((*core->runners)[runner_idx]);
-    
-    std::vector<Chunk *> chunks;
-    std::vector<torch::Tensor> tensors;
-
-    for (size_t read_idx = start; read_idx < end; ++read_idx) {
-        for (size_t chunk_idx = 0; chunk_idx < (*db->chunks)[read_idx].size(); ++chunk_idx) {
-            chunks.push_back(((*db->chunks)[read_idx])[chunk_idx]);
-            tensors.push_back((*db->tensors)[read_idx][chunk_idx]);
-
-            if (chunks.size() == (size_t)opt.gpu_batch_size) {
-                basecall_chunks(
-                    tensors,
-                    chunks,
-                    opt.chunk_size,
-                    model_runner,
-                    ts
-                );
-
-                chunks.clear();
-                tensors.clear();
+    pin_runner(core, runner_idx);
+
+    // One batch is kept in flight: batch k is collected only after batch k + 1 has been submitted,
+    // so the forward pass of k + 1 overlaps the beam search of k.
+    std::vector<Chunk *> pending;
+
+    for (size_t q = queues->size(); q-- > 0; ) {
+        chunk_queue_t* queue = &(*queues)[q];
+
+        for (;;) {
+            int64_t start, end;
+            if (!claim_chunks(queue, opt.gpu_batch_size, &start, &end)) {
+                break;
             }
+
+            std::vector<Chunk *> chunks(queue->chunks.begin() + start, queue->chunks.begin() + end);
+            std::vector<const read_signal_t *> signals(queue->signals.begin() + start, queue->signals.begin() + end);
+
+            //the full chunk size is trimmed to a stride multiple by the runner
+            model_runner.set_batch_chunk_size(std::min((size_t)queue->chunk_size, model_runner.chunk_size()));
+            basecall_submit(chunks, signals, model_runner, ts);
+            if (!pending.empty()) {
+                basecall_collect(pending, model_runner, ts);
+            }
+            pending = chunks;
+            ts->num_chunks += end - start;
         }
     }
 
-    if (chunks.size() > 0) {
-        basecall_chunks(
-            tensors,
-            chunks,
-            opt.chunk_size,
-            model_runner,
-            ts
-        );
+    if (!pending.empty()) {
+        basecall_collect(pending, model_runner, ts);
     }
+
+    ts->time_idle -= realtime();
 }
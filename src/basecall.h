@@ -12,20 +12,26 @@
 #include "slorado.h"
 #include "misc.h"
 
-void basecall_chunks(
-    std::vector<torch::Tensor> tensors,
+/* copy a batch into the runner and start it; the decode may still be running on return */
+void basecall_submit(
     std::vector<Chunk *> chunks,
-    int chunk_size,
+    std::vector<const read_signal_t *> signals,
     ModelRunnerBase &model_runner,
     timestamps_t *ts
 );
 
+/* wait for the oldest submitted batch and store the results in its chunks */
+void basecall_collect(
+    std::vector<Chunk *> chunks,
+    ModelRunnerBase &model_runner,
+    timestamps_t *ts
+);
+
+/* basecall the queues (one per chunk length, longest first) until all are exhausted */
 void basecall_thread(
     core_t* core,
-    db_t* db,
-    size_t runner_idx,
-    size_t start,
-    size_t end
+    std::vector<chunk_queue_t>* queues,
+    size_t runner_idx
 );
 
 #endif
\ No newline at end of file
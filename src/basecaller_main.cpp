@@ -32,10 +32,13 @@ SOFTWARE.
 
 #include "globals.h"
 #include "slorado.h"
+#include "dataflow.h"
 #include "dorado/signal_prep.h"
+#include "dorado/nn/cpu_lstm.h"
 #include "misc.h"
 
 #include <assert.h>
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
 #include <getopt.h>
@@ -65,8 +68,17 @@ static struct option long_options[] = {
     {"overlap", required_argument, 0, 'p'},         //11 overlap [150]
     {"device", required_argument, 0, 'x'},          //12 device [cpu]
     {"num-runners", required_argument, 0, 'r'},     //13 number of runners [1]
-    {"emit-fastq", required_argument, 0, 0},        //14 toggles emit fastq
+    {"emit-fastq", required_argument, 0, 0},        //14 toggles emit fastq (FASTA without qscores otherwise) [yes]
     {"gpu_batchsize", required_argument, 0, 'C'},   //15 gpu batchsize - number of chunks loaded at once [512]
+    {"cpu-lstm", required_argument, 0, 0},          //16 LSTM implementation on the CPU [simd]
+    {"check-cpu-lstm", required_argument, 0, 0},    //17 compare the CPU LSTM kernels against torch on the first batch
+    {"decode-threads", required_argument, 0, 0},    //18 number of CPU beam search threads [torch intra-op threads]
+    {"chunk-buckets", required_argument, 0, 0},     //19 shorter chunk lengths for short reads and read tails [none]
+    {"dataflow", required_argument, 0, 0},          //20 per-read dataflow engine instead of data batches [no]
+    {"ordered", required_argument, 0, 0},           //21 write the reads in input order with the dataflow engine [yes]
+    {"cpu-cores", required_argument, 0, 0},         //22 core budget for -x cpu, split between runners, decoding and -t [none]
+    {"numa", required_argument, 0, 0},              //23 pin the CPU runners and their decode threads to NUMA nodes [no]
+    {"int8-scores", required_argument, 0, 0},       //24 quantise the scores of each batch to int8 for the CPU decoder [no]
     {0, 0, 0, 0}};
 
 
@@ -90,13 +102,82 @@ static inline void print_help_msg(FILE *fp_help, opt_t opt){
     fprintf(fp_help, "  --version                   print version\n");
     fprintf(fp_help, "\nadvanced options:\n");
     fprintf(fp_help, "  --debug-break INT           break after processing the specified no. of batches\n");
-    fprintf(fp_help, "  --emit-fastq=yes|no         emits fastq output format\n");
-    fprintf(fp_help, "  --profile-cpu=yes|no        process section by section (used for profiling on CPU)\n");
+    fprintf(fp_help, "  --emit-fastq=yes|no         emits fastq output format, no writes FASTA and skips the qscores [%s]\n", (opt.flag & SLORADO_EFQ ? "yes" : "no"));
+    fprintf(fp_help, "  --profile-cpu=yes|no        process section by section, without overlapping load, process and output (used for profiling on CPU)\n");
+    fprintf(fp_help, "  --cpu-lstm STR              LSTM implementation on the CPU: simd, int8 or torch [%s]\n", opt.cpu_lstm);
+    fprintf(fp_help, "  --check-cpu-lstm=yes|no     check the simd LSTM against torch on the first batch and exit on mismatch\n");
+    fprintf(fp_help, "  --decode-threads INT        number of CPU beam search threads, shared by all runners [torch intra-op threads]\n");
+    fprintf(fp_help, "  --chunk-buckets INT,...     shorter chunk lengths for short reads and read tails, e.g. 2000,4000 [none]\n");
+    fprintf(fp_help, "  --dataflow=yes|no           stream reads through the stages one by one instead of in data batches of -K reads [%s]\n", (opt.flag & SLORADO_DFL ? "yes" : "no"));
+    fprintf(fp_help, "  --ordered=yes|no            with --dataflow, write the reads in input order [%s]\n", (opt.flag & SLORADO_ORD ? "yes" : "no"));
+    fprintf(fp_help, "  --cpu-cores INT             with -x cpu, split INT cores between the runners' torch threads, --decode-threads and -t [none]\n");
+    fprintf(fp_help, "  --numa=yes|no               with -x cpu, pin each runner, its decode threads and its memory to a NUMA node [%s]\n", (opt.flag & SLORADO_NUM ? "yes" : "no"));
+    fprintf(fp_help, "  --int8-scores=yes|no        quantise the scores of each batch to int8 before decoding (4x less decoder memory, see README) [%s]\n", (opt.flag & SLORADO_I8S ? "yes" : "no"));
 #ifdef HAVE_ACC
     fprintf(fp_help,"   --accel=yes|no             Running on accelerator [%s]\n",(opt.flag&SLORADO_ACC?"yes":"no"));
 #endif
 }
 
+/* Split the --cpu-cores budget. Every runner calls into libtorch concurrently and each call fans out to the
+   intra-op threads, so the forward pass gets runners x intra-op threads. The beam search of the previous batch
+   runs at the same time on the decode pool, and the per-read stages (-t) are light. -t and --decode-threads
+   given explicitly are taken out of the budget as they are. */
+static void split_cpu_cores(opt_t *opt, bool threads_set, char *summary, size_t summary_size) {
+    int32_t cores = opt->cpu_cores;
+    int32_t runners = opt->num_runners;
+
+    int32_t stage_threads = threads_set ? opt->num_thread : std::max(1, cores / 8);
+    int32_t rest = cores - stage_threads;
+    int32_t decode_threads = opt->num_decode_threads > 0 ? opt->num_decode_threads : std::max(1, rest / 3);
+    rest -= decode_threads;
+    int32_t intra_threads = std::max(1, rest / runners);
+
+    int32_t used = runners * intra_threads + decode_threads + stage_threads;
+    if (used > cores) {
+        WARNING("--cpu-cores %d is too small for %d runners, %d threads are used", cores, runners, used);
+    }
+
+    opt->num_thread = stage_threads;
+    opt->num_decode_threads = decode_threads;
+    at::set_num_threads(intra_threads);
+    at::set_num_interop_threads(1);   //the runners do not use inter-op parallelism
+
+    snprintf(summary, summary_size, "%d = %d runners x %d intra-op + %d decode + %d stage threads%s",
+             cores, runners, intra_threads, decode_threads, stage_threads, used < cores ? " (rest idle)" : "");
+}
+
+//function that processes a parsed data batch (runs while the next batch is loaded)
+void* pthread_processor(void* voidargs) {
+    pthread_arg2_t* args = (pthread_arg2_t*)voidargs;
+    db_t* db = args->db;
+    core_t* core = args->core;
+    double realtime0 = core->realtime0;
+
+    double proc_start = realtime();
+    process_db(core, db);
+    args->process_time = realtime() - proc_start;
+
+    fprintf(stderr, "[%s::%.3f*%.2f] %d Entries (%.1fM bytes) processed\n", __func__,
+            realtime() - realtime0, cputime() / (realtime() - realtime0),
+            db->n_rec, db->sum_bytes/(1000.0*1000.0));
+
+    pthread_exit(0);
+}
+
+//function that writes out a processed data batch (runs while the next batch is processed)
+void* pthread_post_processor(void* voidargs) {
+    pthread_arg2_t* args = (pthread_arg2_t*)voidargs;
+    db_t* db = args->db;
+    core_t* core = args->core;
+
+    output_db(core, db);
+    free_db_tmp(db);
+
+    LOG_DEBUG("batch %d written", args->batch_index);
+
+    pthread_exit(0);
+}
+
 int basecaller_main(int argc, char* argv[]) {
     double realtime0 = realtime();
 
@@ -109,6 +190,7 @@ int basecaller_main(int argc, char* argv[]) {
     char *model = NULL;
 
     FILE *fp_help = stderr;
+    bool threads_set = false;   //-t given, --cpu-cores keeps it
 
     opt_t opt;
     init_opt(&opt); //initialise options to defaults
@@ -135,6 +217,7 @@ int basecaller_main(int argc, char* argv[]) {
             }
         } else if (c == 't') {
             opt.num_thread = atoi(optarg);
+            threads_set = true;
             if (opt.num_thread < 1) {
                 ERROR("Number of threads should larger than 0. You entered %d", opt.num_thread);
                 exit(EXIT_FAILURE);
@@ -186,6 +269,36 @@ int basecaller_main(int argc, char* argv[]) {
         #endif
         } else if(c == 0 && longindex == 14) { //sectional benchmark todo : warning for gpu mode
             yes_or_no(&opt.flag, SLORADO_EFQ, long_options[longindex].name, optarg, 1);
+        } else if(c == 0 && longindex == 16) { //cpu lstm implementation
+            if (strcmp(optarg, "simd") != 0 && strcmp(optarg, "int8") != 0 && strcmp(optarg, "torch") != 0) {
+                ERROR("--cpu-lstm should be simd, int8 or torch. You entered %s", optarg);
+                exit(EXIT_FAILURE);
+            }
+            opt.cpu_lstm = optarg;
+        } else if(c == 0 && longindex == 17) { //check cpu lstm
+            yes_or_no(&opt.flag, SLORADO_CHK, long_options[longindex].name, optarg, 1);
+        } else if(c == 0 && longindex == 18) { //decode threads
+            opt.num_decode_threads = atoi(optarg);
+            if (opt.num_decode_threads < 1) {
+                ERROR("Number of decode threads should larger than 0. You entered %d", opt.num_decode_threads);
+                exit(EXIT_FAILURE);
+            }
+        } else if(c == 0 && longindex == 19) { //chunk buckets
+            opt.chunk_buckets = optarg;
+        } else if(c == 0 && longindex == 20) { //dataflow engine
+            yes_or_no(&opt.flag, SLORADO_DFL, long_options[longindex].name, optarg, 1);
+        } else if(c == 0 && longindex == 21) { //ordered dataflow output
+            yes_or_no(&opt.flag, SLORADO_ORD, long_options[longindex].name, optarg, 1);
+        } else if(c == 0 && longindex == 22) { //cpu core budget
+            opt.cpu_cores = atoi(optarg);
+            if (opt.cpu_cores < 1) {
+                ERROR("Number of CPU cores should larger than 0. You entered %d", opt.cpu_cores);
+                exit(EXIT_FAILURE);
+            }
+        } else if(c == 0 && longindex == 23) { //numa placement
+            yes_or_no(&opt.flag, SLORADO_NUM, long_options[longindex].name, optarg, 1);
+        } else if(c == 0 && longindex == 24) { //int8 scores
+            yes_or_no(&opt.flag, SLORADO_I8S, long_options[longindex].name, optarg, 1);
         }
     }
 
@@ -218,6 +331,20 @@ int basecaller_main(int argc, char* argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    char core_split[256] = "";
+    if (opt.cpu_cores > 0) {
+        if (strcmp(opt.device, "cpu") != 0) {
+            WARNING("%s", "--cpu-cores only applies to -x cpu, ignored");
+        } else {
+            split_cpu_cores(&opt, threads_set, core_split, sizeof(core_split));
+        }
+    }
+
+    // by default decode with as many threads as the forward pass uses, so big machines are not capped
+    if (opt.num_decode_threads == 0) {
+        opt.num_decode_threads = at::get_num_threads();
+    }
+
     // print summary
     fprintf(stderr,"\nslorado base-caller version %s\n", SLORADO_VERSION);
     fprintf(stderr,"model path:         %s\n", model);
@@ -225,11 +352,24 @@ int basecaller_main(int argc, char* argv[]) {
     fprintf(stderr,"output path:        %s\n", opt.out_path == NULL ? "stdout" : opt.out_path);
     fprintf(stderr,"device:             %s\n", opt.device);
     fprintf(stderr,"chunk size:         %d\n", opt.chunk_size);
+    if (opt.chunk_buckets != NULL) {
+        fprintf(stderr,"chunk buckets:      %s\n", opt.chunk_buckets);
+    }
     fprintf(stderr,"batch size:         %d\n", opt.batch_size);
+    if (opt.flag & SLORADO_DFL) {
+        fprintf(stderr,"dataflow:           yes (%s output, at most %d reads in flight)\n", opt.flag & SLORADO_ORD ? "ordered" : "unordered", opt.batch_size);
+    }
     fprintf(stderr,"gpu batch size:     %d\n", opt.gpu_batch_size);
     fprintf(stderr,"no. threads:        %d\n", opt.num_thread);
     fprintf(stderr,"no. runners:        %d\n", opt.num_runners);
+    fprintf(stderr,"decode threads:     %d (torch intra-op threads: %d)\n", opt.num_decode_threads, at::get_num_threads());
+    if (core_split[0] != '\0') {
+        fprintf(stderr,"cpu cores:          %s\n", core_split);
+    }
     fprintf(stderr,"overlap:            %d\n", opt.overlap);
+    if (strcmp(opt.device, "cpu") == 0) {
+        fprintf(stderr,"cpu lstm:           %s (%s)\n", opt.cpu_lstm, strcmp(opt.cpu_lstm, "int8") == 0 ? cpu_lstm_int8_isa() : cpu_lstm_isa());
+    }
     fprintf(stderr, "\n");
 
 /////////////////////////////////////////////////////////////////////////////
@@ -237,50 +377,139 @@ int basecaller_main(int argc, char* argv[]) {
     //initialise the core data structure
     core_t* core = init_core(data, opt, model, realtime0);
 
-    int32_t counter=0;
+    //wall time of the load, process and output stages when they overlap (their times below add up to more)
+    double pipeline_time = 0;
+    double pipeline_start = realtime();
 
-    //initialise a databatch
-    db_t* db = init_db(core);
+    if (core->opt.flag & SLORADO_DFL) { //each read moves through the stages on its own
+        dataflow_run(core);
+        pipeline_time = realtime() - pipeline_start;
+    } else if (core->opt.flag & SLORADO_PRF) { //process section by section
+        int32_t counter=0;
 
-    ret_status_t status = {core->opt.batch_size,core->opt.batch_size_bytes};
+        //initialise a databatch
+        db_t* db = init_db(core);
 
-    while (status.num_reads >= core->opt.batch_size || status.num_bytes>=core->opt.batch_size_bytes) {
-        //load a databatch
-        double realtime_d = realtime();
-        
-        status = load_db(core, db);
+        ret_status_t status = {core->opt.batch_size,core->opt.batch_size_bytes};
+
+        while (status.num_reads >= core->opt.batch_size || status.num_bytes>=core->opt.batch_size_bytes) {
+            //load a databatch
+            status = load_db(core, db);
+
+            fprintf(stderr, "[%s::%.3f*%.2f] %d Entries (%.1fM bytes) loaded\n", __func__,
+                    realtime() - realtime0, cputime() / (realtime() - realtime0),
+                    status.num_reads,status.num_bytes/(1000.0*1000.0));
+
+            //process a databatch
+            double proc_start = realtime();
+            parse_db(core, db);
+            process_db(core, db);
+            core->process_db_time += realtime() - proc_start;
+
+            fprintf(stderr, "[%s::%.3f*%.2f] %d Entries (%.1fM bytes) processed\n", __func__,
+                    realtime() - realtime0, cputime() / (realtime() - realtime0),
+                    status.num_reads,status.num_bytes/(1000.0*1000.0));
+
+            //output print
+            output_db(core, db);
+
+            //free temporary
+            free_db_tmp(db);
+
+            if(opt.debug_break==counter){
+                break;
+            }
+            counter++;
+        }
+
+        //free the databatch
+        free_db(db);
+    } else { //interleave loading, processing and output of consecutive batches
+        db_t* db[PIPELINE_DEPTH];
+        pthread_arg2_t pt_args[PIPELINE_DEPTH];
+        for (int32_t j = 0; j < PIPELINE_DEPTH; j++) {
+            db[j] = init_db(core);
+            pt_args[j].core = core;
+            pt_args[j].db = db[j];
+            pt_args[j].process_time = 0;
+        }
 
+        pthread_t tid_proc, tid_out;
+        int32_t ret;
+        int32_t counter = 0;
+
+        ret_status_t status = load_db(core, db[0]);
         fprintf(stderr, "[%s::%.3f*%.2f] %d Entries (%.1fM bytes) loaded\n", __func__,
                 realtime() - realtime0, cputime() / (realtime() - realtime0),
                 status.num_reads,status.num_bytes/(1000.0*1000.0));
-        double realtime_p = realtime();
-        //process a databatch
-        process_db(core, db);
+        if (status.num_reads > 0) {
+            double parse_start = realtime();
+            parse_db(core, db[0]);
+            core->process_db_time += realtime() - parse_start;
+        }
 
-        fprintf(stderr, "[%s::%.3f*%.2f] %d Entries (%.1fM bytes) processed\n", __func__,
-                realtime() - realtime0, cputime() / (realtime() - realtime0),
-                status.num_reads,status.num_bytes/(1000.0*1000.0));
+        while (status.num_reads > 0) {
+            pthread_arg2_t *pt_arg = &pt_args[counter % PIPELINE_DEPTH];
+            pt_arg->batch_index = counter;
+
+            //basecall batch N
+            ret = pthread_create(&tid_proc, NULL, pthread_processor, (void*)(pt_arg));
+            NEG_CHK(ret);
+
+            //meanwhile load and parse batch N+1. Its slot was last used by batch N-2, whose output has been joined
+            if (opt.debug_break == counter) {
+                status.num_reads = 0;
+            } else {
+                db_t* next = db[(counter + 1) % PIPELINE_DEPTH];
+                status = load_db(core, next);
+                fprintf(stderr, "[%s::%.3f*%.2f] %d Entries (%.1fM bytes) loaded\n", __func__,
+                        realtime() - realtime0, cputime() / (realtime() - realtime0),
+                        status.num_reads,status.num_bytes/(1000.0*1000.0));
+                if (status.num_reads > 0) {
+                    double parse_start = realtime();
+                    parse_db(core, next);
+                    core->process_db_time += realtime() - parse_start;
+                }
+            }
 
-        //output print
-        output_db(core, db);
+            ret = pthread_join(tid_proc, NULL);
+            NEG_CHK(ret);
+            core->process_db_time += pt_arg->process_time;
 
-        //free temporary
-        free_db_tmp(db);
+            //batch N-1 must be fully written before batch N is, to keep the output order
+            if (counter > 0) {
+                ret = pthread_join(tid_out, NULL);
+                NEG_CHK(ret);
+            }
+            ret = pthread_create(&tid_out, NULL, pthread_post_processor, (void*)(pt_arg));
+            NEG_CHK(ret);
 
-        if(opt.debug_break==counter){
-            break;
+            counter++;
+        }
+
+        if (counter > 0) {
+            ret = pthread_join(tid_out, NULL);
+            NEG_CHK(ret);
+        }
+
+        pipeline_time = realtime() - pipeline_start;
+
+        for (int32_t j = 0; j < PIPELINE_DEPTH; j++) {
+            free_db(db[j]);
         }
-        //fprintf(stderr, "[%.3f]  Counter : %d \n", realtime() - realtime_d, counter);
-        //fprintf(stderr, "[%.3f]  Counter : %d \n", realtime() - realtime_p, counter);
-        counter++;
     }
 
-    //free the databatch
-    free_db(db);
+    //the reads whose last chunks were held back to fill a batch
+    flush_carried(core);
 
     fprintf(stderr, "[%s] total entries: %ld", __func__,(long)core->total_reads);
     fprintf(stderr,"\n[%s] total bytes: %.1f M",__func__,core->sum_bytes/(float)(1000*1000));
+    //the stage times are summed per stage, so with overlapping stages the percentages are shares of the work done
     double total_time = core->ts.time_init_runners + core->load_db_time + core->process_db_time + core->output_time;
+    if (pipeline_time > 0) {
+        fprintf(stderr, "\n[%s] Load, process and output wall time (overlapped): %.3f sec, stage sum %.3f sec (the percentages below are shares of the work)", __func__,
+                pipeline_time, core->load_db_time + core->process_db_time + core->output_time);
+    }
     fprintf(stderr, "\n[%s] Model initialization time: %.3f sec : %.2f %", __func__,core->ts.time_init_runners,core->ts.time_init_runners * 100 / total_time);
     fprintf(stderr, "\n[%s] Data loading time: %.3f sec : %.2f %", __func__,core->load_db_time,core->load_db_time*100/total_time);
     fprintf(stderr, "\n[%s] Data processing time: %.3f sec : %.2f %", __func__,core->process_db_time,core->process_db_time*100/total_time);
@@ -289,6 +518,11 @@ int basecaller_main(int argc, char* argv[]) {
             fprintf(stderr, "\n[%s]     - Preprocess time: %.3f sec",__func__, core->preproc_time);
             fprintf(stderr, "\n[%s]     - Basecall+decode time: %.3f sec",__func__, core->basecall_time);
             fprintf(stderr, "\n[%s]          - Synchronisation time: %.3f sec",__func__, core->ts.time_sync);
+            for (int32_t b = 0; b < core->num_buckets; ++b) {
+                int64_t capacity = core->bucket_chunks[b] * core->bucket_size[b];
+                fprintf(stderr, "\n[%s]          - Chunk length %d: %ld chunks, %.1f%% signal (rest padding)",__func__, core->bucket_size[b],
+                        (long)core->bucket_chunks[b], capacity > 0 ? core->bucket_samples[b] * 100.0 / capacity : 0.0);
+            }
 
     auto runner_ts = *core->runner_ts;
 
@@ -296,6 +530,8 @@ int basecaller_main(int argc, char* argv[]) {
 
     for (size_t i = 0; i < runner_ts.size(); ++i) {
             fprintf(stderr, "\n[%s]          - Model Runner [%zu] time: %.3f",__func__, i, runner_ts[i]->time_basecall + runner_ts[i]->time_decode + runner_ts[i]->time_accept);
+            fprintf(stderr, "\n[%s]             - Chunks processed: %ld",__func__, (long)runner_ts[i]->num_chunks);
+            fprintf(stderr, "\n[%s]             - Idle time: %.3f sec",__func__, runner_ts[i]->time_idle);
             fprintf(stderr, "\n[%s]             - Accept time: %.3f sec",__func__, runner_ts[i]->time_accept);
             fprintf(stderr, "\n[%s]             - Decode time: %.3f sec",__func__, runner_ts[i]->time_decode);
             if(!isCUDA){
@@ -0,0 +1,347 @@
+/* @file dataflow.cpp
+**
+** per-read dataflow engine
+**
+** The reader thread fetches records and hands each one to the pool, which parses and chunks it and
+** appends its chunks to shared per chunk length queues. The runner threads take batches from those
+** queues as soon as one is full. When the last chunk of a read is decoded the read is stitched on the
+** pool and written, either straight away or through a reorder buffer that restores the input order.
+** At most batch_size reads are in flight, which bounds both the memory and the reorder buffer.
+** @@
+******************************************************************************/
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "dataflow.h"
+#include "basecall.h"
+#include "error.h"
+#include "misc.h"
+#include "thread.h"
+#include "writer.h"
+#include "dorado/signal_prep.h"
+#include "dorado/utils/stitch.h"
+
+#include <slow5/slow5.h>
+
+/* a read on its way through the stages, owned by the engine until it is written */
+typedef struct {
+    int64_t index;          //position in the input, for the ordered output
+    char *mem_record;
+    size_t mem_bytes;
+    slow5_rec_t *rec;
+    read_signal_t signal;   //points into rec
+    std::vector<Chunk *> chunks;
+    int32_t remaining;      //chunks not decoded yet
+    char *sequence;
+    char *qstring;
+} df_read_t;
+
+/* a chunk waiting for a runner */
+typedef struct {
+    Chunk *chunk;
+    df_read_t *read;
+} df_chunk_t;
+
+/* state shared by the reader, the pool tasks and the runner threads */
+typedef struct {
+    core_t *core;
+
+    std::mutex lock;                            //guards the queues and the counters below
+    std::condition_variable chunks_cv;          //runners wait for a batch
+    std::condition_variable space_cv;           //the reader waits for reads to be written
+    std::vector<std::deque<df_chunk_t>> queues; //one per chunk length
+    int64_t in_flight;      //reads fetched but not written yet
+    int64_t preparing;      //reads being parsed and chunked
+    bool reader_blocked;    //no new reads until some are written, so partial batches must go
+    bool input_done;        //end of the input reached
+
+    std::mutex out_lock;                        //guards the output and the reorder buffer
+    bool ordered;
+    int64_t next_out;                           //index of the next read to write when ordered
+    std::map<int64_t, df_read_t *> reorder;     //reads finished ahead of next_out
+} dataflow_t;
+
+static void free_read(df_read_t *read) {
+    for (Chunk *chunk: read->chunks) {
+        delete chunk;
+    }
+    free(read->sequence);
+    free(read->qstring);
+    slow5_rec_free(read->rec);
+    free(read->mem_record);
+    delete read;
+}
+
+static void write_read(core_t *core, df_read_t *read) {
+    if (read->rec->len_raw_signal > 0 && read->sequence != NULL) {
+        write_to_file(core->opt.out, read->sequence, read->qstring, read->rec->read_id, (core->opt.flag & SLORADO_EFQ) != 0);
+    }
+    free_read(read);
+}
+
+/* write the read, or park it until the reads before it are written */
+static void emit_read(dataflow_t *df, df_read_t *read) {
+    core_t *core = df->core;
+    int64_t written = 0;
+
+    {
+        std::lock_guard<std::mutex> guard(df->out_lock);
+        double output_start = realtime();
+        if (!df->ordered) {
+            write_read(core, read);
+            written = 1;
+        } else {
+            df->reorder[read->index] = read;
+            std::map<int64_t, df_read_t *>::iterator it;
+            while ((it = df->reorder.find(df->next_out)) != df->reorder.end()) {
+                write_read(core, it->second);
+                df->reorder.erase(it);
+                df->next_out++;
+                written++;
+            }
+        }
+        core->output_time += realtime() - output_start;
+    }
+
+    if (written > 0) {
+        std::lock_guard<std::mutex> guard(df->lock);
+        df->in_flight -= written;
+        df->space_cv.notify_all();
+    }
+}
+
+/* pool task: parse the record and queue its chunks */
+static void prepare_read(dataflow_t *df, df_read_t *read) {
+    core_t *core = df->core;
+
+    int ret = slow5_decode(&read->mem_record, &read->mem_bytes, &read->rec, core->sp);
+    if (ret < 0) {
+        ERROR("Error parsing the record %ld", (long)read->index);
+        exit(EXIT_FAILURE);
+    }
+
+    if (read->rec->len_raw_signal > 0) {
+        read->signal = read_signal_from_record(read->rec);
+        read->chunks = chunks_from_signal(read->signal.len, core->bucket_size, core->num_buckets, core->opt.overlap);
+    }
+    read->remaining = read->chunks.size();
+
+    //once the chunks are queued the read may be finished and freed by a runner
+    bool no_chunks = read->chunks.empty();
+
+    {
+        std::lock_guard<std::mutex> guard(df->lock);
+        const read_signal_t *signal = &read->signal;
+        for (Chunk *chunk: read->chunks) {
+            int32_t b = chunk_bucket(core, chunk);
+            df->queues[b].push_back({chunk, read});
+            core->bucket_chunks[b]++;
+            core->bucket_samples[b] += chunk->input_offset < signal->len ? std::min(chunk->raw_chunk_size, signal->len - chunk->input_offset) : 0;
+        }
+        df->preparing--;
+        df->chunks_cv.notify_all();
+    }
+
+    if (no_chunks) {
+        emit_read(df, read);
+    }
+}
+
+/* pool task: stitch a read whose chunks are all decoded and write it */
+static void finish_read(dataflow_t *df, df_read_t *read) {
+    std::string sequence;
+    std::string qstring;
+    stitch_chunks(read->chunks, sequence, qstring, (df->core->opt.flag & SLORADO_EFQ) != 0);
+
+    read->sequence = strdup(sequence.c_str());
+    MALLOC_CHK(read->sequence);
+    read->qstring = strdup(qstring.c_str());
+    MALLOC_CHK(read->qstring);
+
+    emit_read(df, read);
+}
+
+/* Take the next batch: a full one of the longest chunk length that has one or, when no more chunks can
+   arrive until the queued ones are decoded, whatever is queued. Returns false when the input is exhausted,
+   or without waiting when nothing is ready and wait is false. */
+static bool take_batch(dataflow_t *df, bool wait, int32_t *bucket, std::vector<Chunk *> &chunks,
+                       std::vector<const read_signal_t *> &signals, std::vector<df_read_t *> &reads,
+                       timestamps_t *ts) {
+    core_t *core = df->core;
+    size_t batch_size = core->opt.gpu_batch_size;
+    int32_t num_queues = df->queues.size();
+
+    std::unique_lock<std::mutex> guard(df->lock);
+    for (;;) {
+        int32_t b = -1;
+        for (int32_t q = num_queues - 1; q >= 0 && b < 0; --q) {
+            if (df->queues[q].size() >= batch_size) {
+                b = q;
+            }
+        }
+        bool drain = df->preparing == 0 && (df->input_done || df->reader_blocked);
+        for (int32_t q = num_queues - 1; q >= 0 && b < 0 && drain; --q) {
+            if (!df->queues[q].empty()) {
+                b = q;
+            }
+        }
+
+        if (b >= 0) {
+            std::deque<df_chunk_t> &queue = df->queues[b];
+            size_t n = std::min(batch_size, queue.size());
+            for (size_t i = 0; i < n; ++i) {
+                chunks.push_back(queue.front().chunk);
+                signals.push_back(&queue.front().read->signal);
+                reads.push_back(queue.front().read);
+                queue.pop_front();
+            }
+            *bucket = b;
+            return true;
+        }
+        if (drain && df->input_done) {
+            return false;
+        }
+        if (!wait) {
+            return false;
+        }
+
+        ts->time_idle -= realtime();
+        df->chunks_cv.wait(guard);
+        ts->time_idle += realtime();
+    }
+}
+
+/* store the results of the oldest submitted batch, reads with all chunks decoded go to the pool */
+static void collect_batch(dataflow_t *df, std::vector<Chunk *> &chunks, std::vector<df_read_t *> &reads,
+                          ModelRunnerBase &model_runner, timestamps_t *ts) {
+    basecall_collect(chunks, model_runner, ts);
+    for (df_read_t *read: reads) {
+        if (__sync_sub_and_fetch(&read->remaining, 1) == 0) {
+            df->core->pool->submit([df, read] { finish_read(df, read); });
+        }
+    }
+    chunks.clear();
+    reads.clear();
+}
+
+static void runner_thread(dataflow_t *df, size_t runner_idx) {
+    core_t *core = df->core;
+    timestamps_t *ts = (*core->runner_ts)[runner_idx];
+    auto& model_runner = *((*core->runners)[runner_idx]);
+    pin_runner(core, runner_idx);
+
+    // as in basecall_thread one batch is kept in flight, it is collected before waiting for more chunks
+    std::vector<Chunk *> pending;
+    std::vector<df_read_t *> pending_reads;
+
+    for (;;) {
+        int32_t b = 0;
+        std::vector<Chunk *> chunks;
+        std::vector<const read_signal_t *> signals;
+        std::vector<df_read_t *> reads;
+
+        if (!take_batch(df, pending.empty(), &b, chunks, signals, reads, ts)) {
+            if (pending.empty()) {
+                break;
+            }
+            collect_batch(df, pending, pending_reads, model_runner, ts);
+            continue;
+        }
+
+        model_runner.set_batch_chunk_size(std::min((size_t)core->bucket_size[b], model_runner.chunk_size()));
+        basecall_submit(chunks, signals, model_runner, ts);
+        if (!pending.empty()) {
+            collect_batch(df, pending, pending_reads, model_runner, ts);
+        }
+        ts->num_chunks += chunks.size();
+        pending.swap(chunks);
+        pending_reads.swap(reads);
+    }
+}
+
+void dataflow_run(core_t* core) {
+    double start = realtime();
+    double load_time = 0;
+
+    dataflow_t *df = new dataflow_t;
+    df->core = core;
+    df->queues.resize(core->num_buckets);
+    df->in_flight = 0;
+    df->preparing = 0;
+    df->reader_blocked = false;
+    df->input_done = false;
+    df->ordered = (core->opt.flag & SLORADO_ORD) != 0;
+    df->next_out = 0;
+
+    size_t num_threads = (*core->runners).size();
+    std::vector<std::unique_ptr<std::thread>> threads;
+    threads.reserve(num_threads);
+    for (size_t runner = 0; runner < num_threads; ++runner) {
+        threads.emplace_back(new std::thread(runner_thread, df, runner));
+    }
+
+    for (int64_t index = 0; ; ++index) {
+        {
+            std::unique_lock<std::mutex> guard(df->lock);
+            if (df->in_flight >= core->opt.batch_size) {
+                df->reader_blocked = true;
+                df->chunks_cv.notify_all();
+                df->space_cv.wait(guard, [df, core] { return df->in_flight < core->opt.batch_size; });
+                df->reader_blocked = false;
+            }
+        }
+
+        double load_start = realtime();
+        df_read_t *read = new df_read_t();
+        read->index = index;
+        if (slow5_get_next_bytes(&read->mem_record, &read->mem_bytes, core->sp) < 0) {
+            if (slow5_errno != SLOW5_ERR_EOF) {
+                ERROR("Error reading from SLOW5 file %d", slow5_errno);
+                exit(EXIT_FAILURE);
+            }
+            delete read;
+            break;
+        }
+        core->total_reads++;
+        core->sum_bytes += read->mem_bytes;
+        load_time += realtime() - load_start;
+
+        {
+            std::lock_guard<std::mutex> guard(df->lock);
+            df->in_flight++;
+            df->preparing++;
+        }
+        core->pool->submit([df, read] { prepare_read(df, read); });
+
+        if (core->total_reads % core->opt.batch_size == 0) {
+            VERBOSE("%ld entries read", (long)core->total_reads);
+        }
+    }
+
+    {
+        std::unique_lock<std::mutex> guard(df->lock);
+        df->input_done = true;
+        df->chunks_cv.notify_all();
+        df->space_cv.wait(guard, [df] { return df->in_flight == 0; });
+    }
+    for (size_t i = 0; i < threads.size(); ++i) {
+        threads[i]->join();
+    }
+    assert(df->reorder.empty());
+    delete df;
+
+    core->load_db_time += load_time;
+    core->process_db_time += realtime() - start - load_time;
+}
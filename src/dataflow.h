@@ -0,0 +1,16 @@
+/* @file dataflow.h
+**
+** per-read dataflow engine: reads move through parse, chunking, basecalling and stitching on their own
+** and are written as soon as their last chunk is decoded, instead of waiting for the rest of a data batch
+** @@
+******************************************************************************/
+
+#ifndef DATAFLOW_H
+#define DATAFLOW_H
+
+#include "slorado.h"
+
+/* basecall the whole input (replaces the load_db/process_db/output_db loop) */
+void dataflow_run(core_t* core);
+
+#endif
@@ -0,0 +1,45 @@
+/* @file pack_model_main.cpp
+**
+** slorado pack-model: writes a model directory as a single packed model file
+** @@
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "error.h"
+#include "misc.h"
+#include "dorado/nn/packed_model.h"
+
+static void print_help_msg(FILE *fp_help) {
+    fprintf(fp_help, "usage: slorado pack-model [model] [output]\n");
+    fprintf(fp_help, "       slorado pack-model --check [output]\n");
+    fprintf(fp_help, "positional arguments:\n");
+    fprintf(fp_help, "  model DIR                   the model directory (config.toml and *.tensor files)\n");
+    fprintf(fp_help, "  output FILE                 the packed model, passed to slorado basecaller in place of the directory\n");
+    fprintf(fp_help, "options:\n");
+    fprintf(fp_help, "  --check                     verify the checksum of all the weights of a packed model (loading only checks the header)\n");
+}
+
+int pack_model_main(int argc, char* argv[]) {
+    if (argc == 2 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0)) {
+        print_help_msg(stdout);
+        exit(EXIT_SUCCESS);
+    }
+    if (argc != 3) {
+        print_help_msg(stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    double realtime0 = realtime();
+    if (strcmp(argv[1], "--check") == 0) {
+        map_packed_model(argv[2], true);
+        fprintf(stderr, "[%s] %s is intact, checked in %.3f sec\n", __func__, argv[2], realtime() - realtime0);
+        return 0;
+    }
+    pack_crf_model(argv[1], argv[2]);
+    fprintf(stderr, "[%s] model packed in %.3f sec\n", __func__, realtime() - realtime0);
+
+    return 0;
+}
@@ -50,6 +50,8 @@ SOFTWARE.
 
 #include "dorado/signal_prep.h"
 #include "basecall.h"
+#include "thread.h"
+#include "topology.h"
 #include "writer.h"
 #include "dorado/utils/stitch.h"
 
@@ -57,9 +59,160 @@ SOFTWARE.
 
 #include <sys/wait.h>
 #include <unistd.h>
+#include <algorithm>
+#include <thread>
 #include <vector>
 
 
+/* model options selected on the command line */
+static CRFModelOptions model_options(opt_t opt) {
+    CRFModelOptions options;
+    if (strcmp(opt.cpu_lstm, "torch") == 0) {
+        options.cpu_lstm = CPULSTMType::Torch;
+    } else if (strcmp(opt.cpu_lstm, "int8") == 0) {
+        options.cpu_lstm = CPULSTMType::Int8;
+    } else {
+        options.cpu_lstm = CPULSTMType::SIMD;
+    }
+    options.check_cpu_lstm = opt.flag & SLORADO_CHK;
+    return options;
+}
+
+/* decoder options selected on the command line */
+static DecoderOptions decoder_options(opt_t opt) {
+    DecoderOptions options;
+    options.int8_scores = (opt.flag & SLORADO_I8S) != 0;
+    options.qstring = (opt.flag & SLORADO_EFQ) != 0; //FASTA needs no qscores
+    return options;
+}
+
+static int cmp_int32(const void *a, const void *b) {
+    int32_t x = *(const int32_t *)a;
+    int32_t y = *(const int32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* set up the chunk lengths from --chunk-buckets, rounded up to a multiple of the model stride */
+static void init_buckets(core_t* core, size_t stride) {
+    opt_t opt = core->opt;
+    core->num_buckets = 0;
+
+    if (opt.chunk_buckets != NULL) {
+#ifdef USE_CUDA_LSTM
+        if (strcmp(opt.device, "cpu") != 0) {
+            WARNING("%s", "--chunk-buckets is ignored with the koi LSTM, which runs a fixed chunk size");
+            opt.chunk_buckets = NULL;
+        }
+#endif
+    }
+
+    if (opt.chunk_buckets != NULL) {
+        char *list = strdup(opt.chunk_buckets);
+        MALLOC_CHK(list);
+        for (char *tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")) {
+            int32_t size = atoi(tok);
+            if (size <= opt.overlap) {
+                ERROR("Chunk bucket sizes should be larger than the overlap (%d). You entered %s", opt.overlap, tok);
+                exit(EXIT_FAILURE);
+            }
+            size = (size + stride - 1) / stride * stride;
+            if (size >= opt.chunk_size) {
+                continue;
+            }
+            if (core->num_buckets == SLORADO_MAX_BUCKETS - 1) {
+                ERROR("At most %d chunk bucket sizes are supported", SLORADO_MAX_BUCKETS - 1);
+                exit(EXIT_FAILURE);
+            }
+            core->bucket_size[core->num_buckets++] = size;
+        }
+        free(list);
+
+        qsort(core->bucket_size, core->num_buckets, sizeof(int32_t), cmp_int32);
+        int32_t n = 0;
+        for (int32_t i = 0; i < core->num_buckets; ++i) {
+            if (n == 0 || core->bucket_size[n - 1] != core->bucket_size[i]) {
+                core->bucket_size[n++] = core->bucket_size[i];
+            }
+        }
+        core->num_buckets = n;
+    }
+
+    core->bucket_size[core->num_buckets++] = opt.chunk_size;
+
+    for (int32_t i = 0; i < core->num_buckets; ++i) {
+        core->bucket_chunks[i] = 0;
+        core->bucket_samples[i] = 0;
+    }
+}
+
+/* with --numa the runners are spread over the NUMA nodes round robin, each node gets its own decode pool */
+static void init_numa(core_t* core) {
+    opt_t opt = core->opt;
+    std::vector<std::vector<int>> nodes = numa_node_cpus();
+    if (nodes.size() < 2) {
+        INFO("%s", "Single NUMA node, --numa ignored");
+        return;
+    }
+
+    int32_t num_nodes = nodes.size();
+    int32_t used_nodes = std::min(num_nodes, opt.num_runners);
+    for (int32_t n = 0; n < used_nodes; ++n) {
+        core->node_pools->push_back(new ThreadPool(std::max(1, opt.num_decode_threads / used_nodes), nodes[n]));
+    }
+    for (int32_t i = 0; i < opt.num_runners; ++i) {
+        core->runner_cpus->push_back(nodes[i % used_nodes]);
+    }
+    VERBOSE("%d runners on %d of %d NUMA nodes, %d decode threads per node", opt.num_runners, used_nodes, num_nodes,
+            std::max(1, opt.num_decode_threads / used_nodes));
+}
+
+void pin_runner(core_t* core, size_t runner_idx) {
+    if (runner_idx < core->runner_cpus->size()) {
+        pin_thread((*core->runner_cpus)[runner_idx]);
+    }
+}
+
+/* The model is loaded once (once per NUMA node with --numa) and the runners share its read-only weights, each
+   with its own input buffer, decoder and activations. Loads and runners are built in parallel. With --numa
+   both happen on threads pinned to the node, so the weights and buffers they touch first (first-touch
+   placement) are allocated there, and each runner decodes on the pool of its node. */
+static void create_cpu_runners(core_t* core, char *model) {
+    opt_t opt = core->opt;
+    size_t num_models = core->node_pools->empty() ? 1 : core->node_pools->size();
+
+    std::vector<SharedModel> models(num_models);
+    std::vector<std::thread> threads;
+    for (size_t m = 0; m < num_models; ++m) {
+        threads.emplace_back([&, m] {
+            pin_runner(core, m); //runner m is on node m
+            CRFModelOptions options = model_options(opt);
+            options.copy_packed_weights = num_models > 1; //pages of a shared mapping stay on the node that read them first
+            models[m] = ModelRunner<CPUDecoder>::load_model(model, opt.device, opt.chunk_size, opt.gpu_batch_size, options);
+        });
+    }
+    for (std::thread &t: threads) {
+        t.join();
+    }
+    threads.clear();
+
+    core->runners->resize(opt.num_runners);
+    for (int32_t i = 0; i < opt.num_runners; ++i) {
+        threads.emplace_back([&, i] {
+            pin_runner(core, i);
+            ThreadPool *pool = core->node_pools->empty() ? core->decode_pool : (*core->node_pools)[i % num_models];
+            (*core->runners)[i] = std::make_shared<ModelRunner<CPUDecoder>>(models[i % num_models], opt.device, opt.chunk_size, opt.gpu_batch_size, pool, decoder_options(opt));
+        });
+    }
+    for (std::thread &t: threads) {
+        t.join();
+    }
+
+    for (int32_t i = 0; i < opt.num_runners; ++i) {
+        core->runner_ts->push_back((timestamps_t *)malloc(sizeof(timestamps_t)));
+        init_timestamps((*core->runner_ts).back());
+    }
+}
+
 /* initialise the core data structure */
 core_t* init_core(char *slow5file, opt_t opt, char *model, double realtime0) {
     core_t* core = (core_t*)malloc(sizeof(core_t));
@@ -75,6 +228,14 @@ core_t* init_core(char *slow5file, opt_t opt, char *model, double realtime0) {
 
     core->opt = opt;
 
+    core->pool = new ThreadPool(opt.num_thread);
+    core->node_pools = new std::vector<ThreadPool *>();
+    core->runner_cpus = new std::vector<std::vector<int>>();
+    if ((opt.flag & SLORADO_NUM) && strcmp(opt.device, "cpu") == 0) {
+        init_numa(core);
+    }
+    core->decode_pool = core->node_pools->empty() ? new ThreadPool(opt.num_decode_threads) : NULL;
+
     core->runners = new std::vector<Runner>();
     core->runner_ts = new std::vector<timestamps_t *>();
 
@@ -82,11 +243,7 @@ core_t* init_core(char *slow5file, opt_t opt, char *model, double realtime0) {
 
 #ifdef USE_GPU
     if (strcmp(opt.device, "cpu") == 0) {
-        for (int i = 0; i < opt.num_runners; ++i) {
-            core->runners->push_back(std::make_shared<ModelRunner<CPUDecoder>>(model, opt.device, opt.chunk_size, opt.gpu_batch_size));
-            core->runner_ts->push_back((timestamps_t *)malloc(sizeof(timestamps_t)));
-            init_timestamps((*core->runner_ts).back());
-        }
+        create_cpu_runners(core, model);
     } else {
         std::vector<std::string> devices;
         std::string device_name = "";
@@ -106,12 +263,15 @@ core_t* init_core(char *slow5file, opt_t opt, char *model, double realtime0) {
         for (auto device: devices) {
 #ifdef USE_CUDA_LSTM
             auto caller = create_cuda_caller(model, opt.chunk_size, opt.gpu_batch_size, device);
+#else
+            //the runners on one device share its copy of the weights
+            auto shared_model = ModelRunner<GPUDecoder>::load_model(model, device, opt.chunk_size, opt.gpu_batch_size, model_options(opt));
 #endif
             for (int i = 0; i < opt.num_runners; ++i) {
 #ifdef USE_CUDA_LSTM
                 core->runners->push_back(std::make_shared<CudaModelRunner>(caller, opt.chunk_size, opt.gpu_batch_size));
 #else
-                core->runners->push_back(std::make_shared<ModelRunner<GPUDecoder>>(model, device, opt.chunk_size, opt.gpu_batch_size));
+                core->runners->push_back(std::make_shared<ModelRunner<GPUDecoder>>(shared_model, device, opt.chunk_size, opt.gpu_batch_size, core->decode_pool, decoder_options(opt)));
 #endif
                 core->runner_ts->push_back((timestamps_t *)malloc(sizeof(timestamps_t)));
                 init_timestamps((*core->runner_ts).back());
@@ -120,11 +280,7 @@ core_t* init_core(char *slow5file, opt_t opt, char *model, double realtime0) {
     }
 #else
     if (strcmp(opt.device, "cpu") == 0) {
-        for (int i = 0; i < opt.num_runners; ++i) {
-            core->runners->push_back(std::make_shared<ModelRunner<CPUDecoder>>(model, opt.device, opt.chunk_size, opt.gpu_batch_size));
-            core->runner_ts->push_back((timestamps_t *)malloc(sizeof(timestamps_t)));
-            init_timestamps((*core->runner_ts).back());
-        }
+        create_cpu_runners(core, model);
     } else {
         fprintf(stderr, "Error. Please compile again for GPU\n");
         exit(EXIT_FAILURE);
@@ -135,6 +291,16 @@ core_t* init_core(char *slow5file, opt_t opt, char *model, double realtime0) {
 
     core->ts.time_init_runners += realtime();
 
+    init_buckets(core, (*core->runners)[0]->model_stride());
+
+    core->leftover = new std::vector<chunk_queue_t>(core->num_buckets);
+    for (int32_t b = 0; b < core->num_buckets; ++b) {
+        (*core->leftover)[b].next = 0;
+        (*core->leftover)[b].chunk_size = core->bucket_size[b];
+    }
+    core->carried = new std::vector<carried_read_t *>();
+    core->held = new std::deque<carried_read_t *>();
+
     //realtime0
     core->realtime0=realtime0;
 
@@ -165,6 +331,16 @@ void free_core(core_t* core,opt_t opt) {
     }
 #endif
 
+    delete core->pool;
+    delete core->decode_pool;
+    for (ThreadPool *pool: *core->node_pools) {
+        delete pool;
+    }
+    delete core->node_pools;
+    delete core->runner_cpus;
+    delete core->leftover;
+    delete core->carried;
+    delete core->held;
     slow5_close(core->sp);
     free(core->runners);
     free(core->runner_ts);
@@ -191,9 +367,11 @@ db_t* init_db(core_t* core) {
     MALLOC_CHK(db->means);
 
     db->chunks = new std::vector<std::vector<Chunk *>>(db->capacity_rec, std::vector<Chunk *>());
-    db->tensors = new std::vector<std::vector<torch::Tensor>>(db->capacity_rec, std::vector<torch::Tensor>());
+    db->signals = new std::vector<read_signal_t>(db->capacity_rec);
     db->sequence = new std::vector<char *>(db->capacity_rec, NULL);
     db->qstring = new std::vector<char *>(db->capacity_rec, NULL);
+    db->completed = new std::vector<carried_read_t *>();
+    db->carried = new std::vector<carried_read_t *>(db->capacity_rec, NULL);
 
     db->total_reads=0;
     db->sum_bytes=0;
@@ -271,56 +449,138 @@ void preprocess_signal(core_t* core,db_t* db, int32_t i){
     opt_t opt = core->opt;
 
     if (len_raw_signal > 0) {
-        torch::Tensor signal = tensor_from_record(rec).to(torch::kCPU);
+        //the samples are normalised later, when the runners copy the chunks into their batch
+        read_signal_t signal = read_signal_from_record(rec);
+        (*db->signals)[i] = signal;
 
-        scale_signal(signal, rec->range / rec->digitisation, rec->offset);
-
-        std::vector<Chunk *> chunks = chunks_from_tensor(signal, opt.chunk_size, opt.overlap);
+        std::vector<Chunk *> chunks = chunks_from_signal(signal.len, core->bucket_size, core->num_buckets, opt.overlap);
 
         (*db->chunks)[i] = chunks;
         LOG_DEBUG("%s","assigned chunks");
+    }
+}
+
+/* bucket of a chunk, by its length */
+int32_t chunk_bucket(core_t* core, const Chunk *chunk) {
+    int32_t b = 0;
+    while (b < core->num_buckets - 1 && (size_t)core->bucket_size[b] != chunk->raw_chunk_size) {
+        b++;
+    }
+    return b;
+}
 
-        std::vector<torch::Tensor> tensors = tensor_as_chunks(signal, chunks, opt.chunk_size);
+static void queue_push(chunk_queue_t* queue, Chunk *chunk, const read_signal_t *signal, int32_t read, carried_read_t *carried) {
+    queue->chunks.push_back(chunk);
+    queue->signals.push_back(signal);
+    queue->reads.push_back(read);
+    queue->carried.push_back(carried);
+}
 
-        (*db->tensors)[i] = tensors;
-        LOG_DEBUG("%s","assigned tensors");
+/* take read i out of the data batch, it is completed with a later one */
+static carried_read_t* carry_read(core_t* core, db_t* db, int32_t i) {
+    carried_read_t *read = new carried_read_t;
+    read->read_id = strdup(db->slow5_rec[i]->read_id);
+    MALLOC_CHK(read->read_id);
+    const read_signal_t &signal = (*db->signals)[i];
+    read->raw.assign(signal.raw, signal.raw + signal.len);
+    read->signal = signal;
+    read->signal.raw = read->raw.data();
+    read->chunks.swap((*db->chunks)[i]);   //so the batch neither stitches nor writes it
+    read->pending = 0;
+    read->sequence = NULL;
+    read->qstring = NULL;
+    read->ready = false;
+    core->carried->push_back(read);
+    (*db->carried)[i] = read;              //output_db keeps its place in the output
+    return read;
+}
+
+/* hold back the chunks that do not fill a whole batch, so every forward pass but the very last one is full */
+static void hold_back_leftover(core_t* core, db_t* db, std::vector<chunk_queue_t> &queues) {
+    int64_t batch = core->opt.gpu_batch_size;
+    std::vector<carried_read_t *> carried_from_db(db->n_rec, NULL);
+
+    for (carried_read_t *read: *core->carried) {
+        read->pending = 0;
+    }
+
+    for (int32_t b = 0; b < core->num_buckets; ++b) {
+        chunk_queue_t* queue = &queues[b];
+        chunk_queue_t* leftover = &(*core->leftover)[b];
+        int64_t n = queue->chunks.size();
+        int64_t keep = n - n % batch;
+
+        for (int64_t j = keep; j < n; ++j) {
+            carried_read_t *read = queue->carried[j];
+            if (read == NULL) {
+                int32_t i = queue->reads[j];
+                if (carried_from_db[i] == NULL) {
+                    carried_from_db[i] = carry_read(core, db, i);
+                }
+                read = carried_from_db[i];
+            }
+            read->pending++;
+            queue_push(leftover, queue->chunks[j], &read->signal, -1, read);
+        }
+
+        queue->chunks.resize(keep);
+        queue->signals.resize(keep);
+        queue->reads.resize(keep);
+        queue->carried.resize(keep);
     }
 }
 
-void basecall_db(core_t* core, db_t* db) {
+/* basecall the queues on all runners */
+/* Split the last wave of batches evenly across the runners. Runners take gpu_batch_size chunks at a time, so
+   when the chunks of the data batch are not a multiple of runners x gpu_batch_size the last few batches go to
+   a few runners while the others idle. Long reads make this worse, their chunks fill whole waves. */
+static void balance_tail(core_t* core, std::vector<chunk_queue_t> &queues, int64_t num_runners) {
+    int64_t batch = core->opt.gpu_batch_size;
+    int64_t total = 0;
+    for (chunk_queue_t &queue: queues) {
+        queue.tail_start = queue.chunks.size();
+        queue.tail_portion = batch;
+        total += queue.chunks.size();
+    }
+
+    int64_t tail = total % (batch * num_runners);
+    if (num_runners < 2 || tail == 0) {
+        return;
+    }
+    //the runners walk the queues longest first, so the tail is in the shortest non-empty one
+    for (chunk_queue_t &queue: queues) {
+        int64_t n = queue.chunks.size();
+        if (n > 0) {
+            tail = std::min(tail, n);
+            queue.tail_start = n - tail;
+            queue.tail_portion = (tail + num_runners - 1) / num_runners;
+            break;
+        }
+    }
+}
+
+static void run_queues(core_t* core, std::vector<chunk_queue_t> &queues) {
     timestamps_t *ts = &(core->ts);
 
     size_t num_threads = (*core->runners).size();
-    size_t n_reads = (*db->chunks).size();
+
+    balance_tail(core, queues, num_threads);
 
     std::vector<std::unique_ptr<std::thread>> threads;
     threads.reserve(num_threads);
 
-    size_t reads_per_thread = (n_reads + num_threads - 1) / num_threads;
-
-    size_t start = 0;
-    size_t end = reads_per_thread;
-
-    bool last = false;
-    for (size_t runner = 0; runner < (*core->runners).size(); ++runner) {
+    for (size_t runner = 0; runner < num_threads; ++runner) {
         threads.emplace_back(
             new std::thread(
                 basecall_thread,
                 core,
-                db,
-                runner,
-                start,
-                end
+                &queues,
+                runner
             )
         );
-        start = end;
-        end = std::min(end + reads_per_thread, n_reads);
-
-        if (last) break;
-        if (end == n_reads) last = true;
     }
 
-    auto time_sync = 0;
+    double time_sync = 0;
 
     for (size_t i = 0; i < threads.size(); ++i) {
         threads[i]->join();
@@ -332,19 +592,116 @@ void basecall_db(core_t* core, db_t* db) {
         }
     }
     ts->time_sync += time_sync;
+
+    //each runner started its idle clock when it found the queue empty
+    double sync_end = realtime();
+    for (size_t i = 0; i < num_threads; ++i) {
+        (*core->runner_ts)[i]->time_idle += sync_end;
+    }
 }
 
+void basecall_db(core_t* core, db_t* db) {
+    //the chunks held back from the previous batch go first, then all chunks of this batch in read order,
+    //one queue per chunk length, handed out in gpu_batch_size portions
+    std::vector<chunk_queue_t> queues;
+    queues.swap(*core->leftover);
+    core->leftover->resize(core->num_buckets);
+    for (int32_t b = 0; b < core->num_buckets; ++b) {
+        queues[b].next = 0;
+        (*core->leftover)[b].next = 0;
+        (*core->leftover)[b].chunk_size = core->bucket_size[b];
+    }
+    for (int32_t i = 0; i < db->n_rec; ++i) {
+        const read_signal_t *signal = &(*db->signals)[i];
+        for (Chunk *chunk: (*db->chunks)[i]) {
+            int32_t b = chunk_bucket(core, chunk);
+            queue_push(&queues[b], chunk, signal, i, NULL);
+            core->bucket_chunks[b]++;
+            core->bucket_samples[b] += chunk->input_offset < signal->len ? std::min(chunk->raw_chunk_size, signal->len - chunk->input_offset) : 0;
+        }
+    }
+
+    hold_back_leftover(core, db, queues);
+
+    run_queues(core, queues);
+
+    //carried reads with nothing held back any more are complete, they are written with this batch
+    std::vector<carried_read_t *> still_carried;
+    for (carried_read_t *read: *core->carried) {
+        if (read->pending == 0) {
+            db->completed->push_back(read);
+        } else {
+            still_carried.push_back(read);
+        }
+    }
+    core->carried->swap(still_carried);
+}
+
+static void stitch_carried(core_t* core, carried_read_t *read) {
+    std::string sequence;
+    std::string qstring;
+    stitch_chunks(read->chunks, sequence, qstring, (core->opt.flag & SLORADO_EFQ) != 0);
+    read->sequence = strdup(sequence.c_str());
+    MALLOC_CHK(read->sequence);
+    read->qstring = strdup(qstring.c_str());
+    MALLOC_CHK(read->qstring);
+}
+
+static void free_carried(carried_read_t *read) {
+    for (Chunk *chunk: read->chunks) delete chunk;
+    free(read->read_id);
+    free(read->sequence);
+    free(read->qstring);
+    delete read;
+}
+
+/* write the held reads up to the first one that is not complete yet */
+static void write_held(core_t* core) {
+    while (!core->held->empty() && core->held->front()->ready) {
+        carried_read_t *read = core->held->front();
+        write_to_file(core->opt.out, read->sequence, read->qstring, read->read_id, (core->opt.flag & SLORADO_EFQ) != 0);
+        free_carried(read);
+        core->held->pop_front();
+    }
+}
+
+/* basecall the chunks still held back after the last data batch and write the held reads */
+void flush_carried(core_t* core) {
+    if (core->carried->empty()) {
+        return;
+    }
+
+    double a = realtime();
+    std::vector<chunk_queue_t> queues;
+    queues.swap(*core->leftover);
+    run_queues(core, queues);
+    double b = realtime();
+    core->basecall_time += (b-a);
+    core->process_db_time += (b-a);
+
+    a = realtime();
+    for (carried_read_t *read: *core->carried) {
+        stitch_carried(core, read);
+        read->ready = true;
+    }
+    core->carried->clear();
+    write_held(core);
+    assert(core->held->empty());
+    b = realtime();
+    core->output_time += (b-a);
+}
 
 void postprocess_signal(core_t* core,db_t* db, int32_t i){
     slow5_rec_t* rec = db->slow5_rec[i];
     uint64_t len_raw_signal = rec->len_raw_signal;
 
-    if (len_raw_signal > 0) {
+    //reads with held back chunks have been handed over to core->carried
+    if (len_raw_signal > 0 && !(*db->chunks)[i].empty()) {
         std::vector<Chunk *> chunks = (*db->chunks)[i];
 
         std::string sequence;
         std::string qstring;
-        stitch_chunks(chunks, sequence, qstring);
+        stitch_chunks(chunks, sequence, qstring, (core->opt.flag & SLORADO_EFQ) != 0);
 
         (*db->sequence)[i] = strdup(sequence.c_str());
         assert((*db->sequence)[i] != NULL);
@@ -354,18 +711,19 @@ void postprocess_signal(core_t* core,db_t* db, int32_t i){
     }
 }
 
-void process_db(core_t* core,db_t* db){
-    double proc_start = realtime();
-
+/* parse the records of a loaded data batch */
+void parse_db(core_t* core, db_t* db) {
     double a = realtime();
     work_db(core,db,parse_single);
     double b = realtime();
     core->parse_time += (b-a);
-    LOG_DEBUG("%s","Parsed reads");  
+    LOG_DEBUG("%s","Parsed reads");
+}
 
-    a = realtime();
+void process_db(core_t* core,db_t* db){
+    double a = realtime();
     work_db(core,db,preprocess_signal);
-    b = realtime();
+    double b = realtime();
     core->preproc_time += (b-a);
     LOG_DEBUG("%s","Preprocessed reads");
     
@@ -377,22 +735,44 @@ void process_db(core_t* core,db_t* db){
     
     a = realtime();
     work_db(core,db,postprocess_signal);
+    for (carried_read_t *read: *db->completed) {
+        stitch_carried(core, read);
+    }
     b = realtime();
     core->postproc_time += (b-a);
     LOG_DEBUG("%s","Postprocessed reads");
-    
-    double proc_end = realtime();
-    core->process_db_time += (proc_end-proc_start);
 }
 
 /* write the output for a processed data batch */
 void output_db(core_t* core, db_t* db) {
     double output_start = realtime();
 
+    //the earlier reads completed with this batch were stitched by process_db, they are already in core->held
+    for (carried_read_t *read: *db->completed) {
+        read->ready = true;
+    }
+    write_held(core);
+
+    //a read whose chunks were held back takes its place in core->held, the reads after it wait there
     int32_t i = 0;
     for (i = 0; i < db->n_rec; i++) {
-        if(db->slow5_rec[i]->len_raw_signal>0){
-            write_to_file(core->opt.out, (*db->sequence)[i], (*db->qstring)[i], db->slow5_rec[i]->read_id, (core->opt.flag & SLORADO_EFQ) != 0);
+        if ((*db->carried)[i] != NULL) {
+            core->held->push_back((*db->carried)[i]);
+        } else if(db->slow5_rec[i]->len_raw_signal>0 && (*db->sequence)[i] != NULL){
+            if (core->held->empty()) {
+                write_to_file(core->opt.out, (*db->sequence)[i], (*db->qstring)[i], db->slow5_rec[i]->read_id, (core->opt.flag & SLORADO_EFQ) != 0);
+            } else {
+                carried_read_t *read = new carried_read_t;
+                read->read_id = strdup(db->slow5_rec[i]->read_id);
+                MALLOC_CHK(read->read_id);
+                read->sequence = (*db->sequence)[i];
+                read->qstring = (*db->qstring)[i];
+                read->pending = 0;
+                (*db->sequence)[i] = NULL;
+                (*db->qstring)[i] = NULL;
+                read->ready = true;
+                core->held->push_back(read);
+            }
         }
     }
 
@@ -411,7 +791,15 @@ void free_db_tmp(db_t* db) {
         free(db->mem_records[i]);
         free((*db->sequence)[i]);
         free((*db->qstring)[i]);
+        (*db->sequence)[i] = NULL;
+        (*db->qstring)[i] = NULL;
+        // the batch is reused for the next load, so stale chunks must not be basecalled again
+        for (Chunk *chunk: (*db->chunks)[i]) delete chunk;
+        (*db->chunks)[i].clear();
+        (*db->carried)[i] = NULL;
     }
+    //the completed reads are freed when core->held writes them
+    db->completed->clear();
 }
 
 /* completely free a data batch */
@@ -428,7 +816,9 @@ void free_db(db_t* db) {
     free(db->chunks);
     free(db->sequence);
     free(db->qstring);
-    free(db->tensors);
+    free(db->signals);
+    delete db->completed;
+    delete db->carried;
     free(db);
 }
 
@@ -446,10 +836,12 @@ void init_opt(opt_t* opt) {
     opt->chunk_size = 8000;
     opt->overlap = 150;
     opt->num_runners = 1;
+    opt->cpu_lstm = "simd";
 
     opt->out = stdout;
 
     opt->flag |= SLORADO_EFQ;
+    opt->flag |= SLORADO_ORD;
 
 #ifdef HAVE_ACC
     opt->flag |= SLORADO_ACC;
@@ -477,6 +869,8 @@ void init_timestamps(timestamps_t* time_stamps) {
     time_stamps->time_write = 0;
     time_stamps->time_total = 0;
     time_stamps->time_beam_search_emplace = 0;
+    time_stamps->time_idle = 0;
+    time_stamps->num_chunks = 0;
     // time_stamps->time_forward = 0;
     // time_forward = 0;
     // forward_l62 = 0;
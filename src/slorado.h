@@ -36,6 +36,7 @@ SOFTWARE.
 #include <stdlib.h>
 #include <stdint.h>
 #include <slow5/slow5.h>
+#include <deque>
 #include <vector>
 #include <memory>
 #include "dorado/nn/ModelRunner.h"
@@ -43,6 +44,8 @@ SOFTWARE.
 
 #define SLORADO_VERSION "0.1.0"
 
+class ThreadPool;
+
 /*******************************************************
  * flags related to the user specified options (opt_t) *
  *******************************************************/
@@ -50,9 +53,15 @@ SOFTWARE.
 #define SLORADO_PRF 0x001 //cpu-profile mode
 #define SLORADO_ACC 0x002 //accelerator enable
 #define SLORADO_EFQ 0x004 //emit fastq enable
+#define SLORADO_CHK 0x008 //check the CPU LSTM kernels against torch
+#define SLORADO_DFL 0x010 //per-read dataflow engine instead of data batches
+#define SLORADO_ORD 0x020 //dataflow engine writes the reads in input order
+#define SLORADO_NUM 0x040 //pin the CPU runners and their decode threads to NUMA nodes
+#define SLORADO_I8S 0x080 //int8 scores between the NN and the CPU decoder
+
+#define SLORADO_MAX_BUCKETS 8 //max number of chunk lengths, including the full chunk size
 
-#define WORK_STEAL 1 //simple work stealing enabled or not (no work stealing mean no load balancing)
-#define STEAL_THRESH 1 //stealing threshold
+#define PIPELINE_DEPTH 3 //number of data batches in rotation when load, process and output are interleaved
 
 /* user specified options */
 typedef struct {
@@ -71,9 +80,39 @@ typedef struct {
     int32_t chunk_size;         //size of chunks: c
     int32_t overlap;            //overlap: p
     int32_t num_runners;       //number of runners: r
+
+    const char *cpu_lstm;       //LSTM implementation on the CPU (simd, int8 or torch)
+    int32_t num_decode_threads; //threads for the CPU beam search, 0 for torch's intra-op thread count
+    const char *chunk_buckets;  //comma separated shorter chunk lengths for short reads and read tails, NULL for none
+    int32_t cpu_cores;          //core budget split between runners, decoding and the per-read stages, 0 for none
 } opt_t;
 
 
+/* a read with chunks held back to fill a batch of the next data batch; it is completed there.
+   Reads waiting behind one in the output are kept in the same form, with no chunks. */
+typedef struct {
+    char *read_id;                  //copied, the record is reused by later loads
+    std::vector<int16_t> raw;       //copy of the trimmed signal, signal.raw points into it
+    read_signal_t signal;
+    std::vector<Chunk *> chunks;    //all chunks of the read
+    int32_t pending;                //chunks still held back
+    char *sequence;
+    char *qstring;
+    bool ready;                     //stitched and can be written, set and read by output_db only
+} carried_read_t;
+
+/* chunks of one chunk length, shared by all runners (runners pull from next until it is exhausted) */
+typedef struct {
+    std::vector<Chunk *> chunks;
+    std::vector<const read_signal_t *> signals;   //read of each chunk
+    std::vector<int32_t> reads;                   //index of the read in the data batch, -1 if carried
+    std::vector<carried_read_t *> carried;        //carried read of each chunk, NULL if in the data batch
+    int64_t next;   //index of the first chunk not yet handed out
+    int64_t tail_start;     //chunks from here on are handed out in tail_portion instead of gpu_batch_size portions
+    int64_t tail_portion;
+    int32_t chunk_size;
+} chunk_queue_t;
+
 /* a batch of read data (dynamic data based on the reads) */
 typedef struct {
     int32_t n_rec;
@@ -87,11 +126,14 @@ typedef struct {
     double *means;
 
     std::vector<std::vector<Chunk *>> *chunks;
-    std::vector<std::vector<torch::Tensor>> *tensors;
+    std::vector<read_signal_t> *signals;    //trimmed raw signal and normalisation of each read
 
     std::vector<char *> *sequence;
     std::vector<char *> *qstring;
 
+    std::vector<carried_read_t *> *completed;   //earlier reads whose held back chunks were basecalled with this batch
+    std::vector<carried_read_t *> *carried;     //read i if its chunks were held back for a later batch, else NULL
+
     //stats
     int64_t sum_bytes;
     int64_t total_reads; //total number mapped entries in the bam file (after filtering based on flags, mapq etc)
@@ -116,7 +158,9 @@ typedef struct {
     double_t time_write;
     double_t time_total;
     double_t time_beam_search_emplace;
+    double_t time_idle;     //time a runner waited for the others after the chunk queue ran dry
 
+    int64_t num_chunks;     //chunks basecalled by a runner
 } timestamps_t;
 
 /* core data structure (mostly static data throughout the program lifetime) */
@@ -127,10 +171,30 @@ typedef struct {
     // options
     opt_t opt;
 
+    // persistent worker threads for the per-read stages (parse, preprocess, postprocess)
+    ThreadPool *pool;
+    // persistent worker threads for the CPU beam search, shared by all runners
+    ThreadPool *decode_pool;
+    // with --numa: a decode pool per NUMA node and the cpus of the node of each runner, empty otherwise
+    std::vector<ThreadPool *> *node_pools;
+    std::vector<std::vector<int>> *runner_cpus;
+
     // create model runner
     // only one is used for now
     std::vector<Runner> *runners;
 
+    // chunk lengths in ascending order (stride aligned), the last one is the full chunk size
+    int32_t num_buckets;
+    int32_t bucket_size[SLORADO_MAX_BUCKETS];
+    int64_t bucket_chunks[SLORADO_MAX_BUCKETS];     //chunks basecalled at each length
+    int64_t bucket_samples[SLORADO_MAX_BUCKETS];    //signal samples in them, the rest is repeat padding
+
+    // chunks of the partial last batch of each chunk length, held back for the next data batch
+    std::vector<chunk_queue_t> *leftover;
+    std::vector<carried_read_t *> *carried;
+    // reads to be written in input order, from the first carried read that is not complete yet
+    std::deque<carried_read_t *> *held;
+
     //realtime0
     double realtime0;
 
@@ -149,22 +213,13 @@ typedef struct {
     int64_t total_reads; //total number mapped entries in the bam file (after filtering based on flags, mapq etc)
 } core_t;
 
-/* argument wrapper for the multithreaded framework used for data processing */
+/* argument wrapper for the interleaved (pipelined) processing and output of data batches */
 typedef struct {
     core_t* core;
     db_t* db;
-    int32_t starti;
-    int32_t endi;
-    void (*func)(core_t*,db_t*,int);
-    int32_t thread_index;
-#ifdef WORK_STEAL
-    void *all_pthread_args;
-#endif
-#ifdef HAVE_CUDA
-    int32_t *ultra_long_reads; //reads that are assigned to the CPU due to the unsuitability to process on the GPU
-    double ret1;    //return value
-#endif
-} pthread_arg_t;
+    int32_t batch_index;
+    double process_time;    //process_db time of the batch, added to core->process_db_time after the join
+} pthread_arg2_t;
 
 /* return status by the load_db - used for termination when all the data is processed */
 typedef struct {
@@ -188,11 +243,14 @@ db_t* init_db(core_t* core);
 /* load a data batch from disk */
 ret_status_t load_db(core_t* dg, db_t* db);
 
+/* parse the records of a loaded data batch (the caller adds it to process_db_time) */
+void parse_db(core_t* core, db_t* db);
+
 void work_per_single_read(core_t* core,db_t* db, int32_t i);
 /* process all reads in the given batch db */
 void work_db(core_t* core, db_t* db, void (*func)(core_t*,db_t*,int));
 
-/* process a data batch */
+/* process a parsed data batch (the caller adds it to process_db_time) */
 void process_db(core_t* core, db_t* db);
 
 /* align a single read specified by index i*/
@@ -201,6 +259,15 @@ void process_single(core_t* core, db_t* db, int32_t i);
 /* write the output for a processed data batch */
 void output_db(core_t* core, db_t* db);
 
+/* pin the calling thread to the NUMA node of the runner (no-op without --numa) */
+void pin_runner(core_t* core, size_t runner_idx);
+
+/* index of the chunk length (in core->bucket_size) of a chunk */
+int32_t chunk_bucket(core_t* core, const Chunk *chunk);
+
+/* basecall and write the chunks still held back after the last data batch */
+void flush_carried(core_t* core);
+
 /* partially free a data batch - only the read dependent allocations are freed */
 void free_db_tmp(db_t* db);
 
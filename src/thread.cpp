@@ -1,6 +1,6 @@
 /**
  * @file thread.c
- * @brief multi-thread implementation skeleton
+ * @brief multi-thread implementation skeleton (persistent work-stealing pool)
  * @author Hasindu Gamaarachchi (hasindu@garvan.org.au)
 
 MIT License
@@ -28,101 +28,148 @@ SOFTWARE.
 
 ******************************************************************************/
 
-#include <pthread.h>
+#include <algorithm>
+#include <chrono>
+
 #include "slorado.h"
+#include "thread.h"
+#include "topology.h"
 #include "error.h"
 #include "misc.h"
 
-static inline int32_t steal_work(pthread_arg_t* all_args, int32_t n_threads) {
-	int32_t i, c_i = -1;
-	int32_t k;
-	for (i = 0; i < n_threads; ++i){
-        pthread_arg_t args = all_args[i];
-        //fprintf(stderr,"endi : %d, starti : %d\n",args.endi,args.starti);
-		if (args.endi-args.starti > STEAL_THRESH) {
-            //fprintf(stderr,"gap : %d\n",args.endi-args.starti);
-            c_i = i;
-            break;
-        }
+thread_local int ThreadPool::t_worker_idx = -1;
+thread_local const ThreadPool *ThreadPool::t_pool = NULL;
+
+ThreadPool::ThreadPool(int num_threads, const std::vector<int> &cpus)
+    : m_cpus(cpus), m_queued(0), m_next_worker(0), m_terminate(false) {
+    ASSERT(num_threads > 0);
+    for (int i = 0; i < num_threads; ++i) {
+        m_workers.emplace_back(new Worker());
     }
-    if(c_i<0){
-        return -1;
+    for (int i = 0; i < num_threads; ++i) {
+        m_threads.emplace_back(&ThreadPool::worker_loop, this, i);
     }
-	k = __sync_fetch_and_add(&(all_args[c_i].starti), 1);
-    //fprintf(stderr,"k : %d, end %d, start %d\n",k,all_args[c_i].endi,all_args[c_i].starti);
-	return k >= all_args[c_i].endi ? -1 : k;
 }
 
-void* pthread_single(void* voidargs) {
-    int32_t i;
-    pthread_arg_t* args = (pthread_arg_t*)voidargs;
-    db_t* db = args->db;
-    core_t* core = args->core;
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(m_sleep_lock);
+        m_terminate = true;
+    }
+    m_sleep_cv.notify_all();
+    for (auto &thread : m_threads) {
+        thread.join();
+    }
+}
 
-#ifndef WORK_STEAL
-    for (i = args->starti; i < args->endi; i++) {
-        args->func(core,db,i);
+void ThreadPool::submit(std::function<void()> task) {
+    int n = (int)m_workers.size();
+    int target = (t_pool == this) ? t_worker_idx : (int)(m_next_worker++ % n);
+    {
+        std::lock_guard<std::mutex> lock(m_workers[target]->lock);
+        m_workers[target]->tasks.push_back(std::move(task));
     }
-#else
-    pthread_arg_t* all_args = (pthread_arg_t*)(args->all_pthread_args);
-    //adapted from kthread.c in minimap2
-    for (;;) {
-		i = __sync_fetch_and_add(&args->starti, 1);
-		if (i >= args->endi) {
-            break;
+    {
+        //incremented under the sleep lock so that a worker about to sleep cannot miss it
+        std::lock_guard<std::mutex> lock(m_sleep_lock);
+        m_queued++;
+    }
+    m_sleep_cv.notify_one();
+}
+
+//own deque first (newest task, still warm in cache), then steal the oldest task of the others
+bool ThreadPool::pop_task(std::function<void()> &task) {
+    int n = (int)m_workers.size();
+    int self = (t_pool == this) ? t_worker_idx : -1;
+
+    if (self >= 0) {
+        Worker &w = *m_workers[self];
+        std::lock_guard<std::mutex> lock(w.lock);
+        if (!w.tasks.empty()) {
+            task = std::move(w.tasks.back());
+            w.tasks.pop_back();
+            m_queued--;
+            return true;
         }
-		args->func(core,db,i);
-	}
-	while ((i = steal_work(all_args,core->opt.num_thread)) >= 0){
-		args->func(core,db,i);
     }
-#endif
 
-    //fprintf(stderr,"Thread %d done\n",(myargs->position)/THREADS);
-    pthread_exit(0);
+    int first = (self >= 0) ? self + 1 : 0;
+    for (int k = 0; k < n; ++k) {
+        int victim = (first + k) % n;
+        if (victim == self) continue;
+        Worker &w = *m_workers[victim];
+        std::lock_guard<std::mutex> lock(w.lock);
+        if (!w.tasks.empty()) {
+            task = std::move(w.tasks.front());
+            w.tasks.pop_front();
+            m_queued--;
+            return true;
+        }
+    }
+    return false;
 }
 
-void pthread_db(core_t* core, db_t* db, void (*func)(core_t*,db_t*,int)){
-    //create threads
-    pthread_t tids[core->opt.num_thread];
-    pthread_arg_t pt_args[core->opt.num_thread];
-    int32_t t, ret;
-    int32_t i = 0;
-    int32_t num_thread = core->opt.num_thread;
-    int32_t step = (db->n_rec + num_thread - 1) / num_thread;
-    //todo : check for higher num of threads than the data
-    //current works but many threads are created despite
-
-    //set the data structures
-    for (t = 0; t < num_thread; t++) {
-        pt_args[t].core = core;
-        pt_args[t].db = db;
-        pt_args[t].starti = i;
-        i += step;
-        if (i > db->n_rec) {
-            pt_args[t].endi = db->n_rec;
-        } else {
-            pt_args[t].endi = i;
+void ThreadPool::worker_loop(int idx) {
+    t_worker_idx = idx;
+    t_pool = this;
+    if (!m_cpus.empty()) {
+        pin_thread(m_cpus);
+    }
+
+    std::function<void()> task;
+    for (;;) {
+        if (pop_task(task)) {
+            task();
+            task = nullptr;
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(m_sleep_lock);
+        m_sleep_cv.wait(lock, [this] { return m_terminate || m_queued > 0; });
+        if (m_terminate && m_queued == 0) {
+            return;
         }
-        pt_args[t].func=func;
-    #ifdef WORK_STEAL
-        pt_args[t].all_pthread_args =  (void *)pt_args;
-    #endif
-        //fprintf(stderr,"t%d : %d-%d\n",t,pt_args[t].starti,pt_args[t].endi);
     }
+}
 
-    //create threads
-    for(t = 0; t < core->opt.num_thread; t++){
-        ret = pthread_create(&tids[t], NULL, pthread_single,
-                                (void*)(&pt_args[t]));
-        NEG_CHK(ret);
+void ThreadPool::parallel_for(int64_t n, int64_t grain, const std::function<void(int64_t)> &func) {
+    if (n <= 0) return;
+    if (grain < 1) grain = 1;
+
+    struct {
+        std::atomic<int64_t> remaining;
+        std::mutex lock;
+        std::condition_variable cv;
+    } latch;
+    int64_t num_tasks = (n + grain - 1) / grain;
+    latch.remaining = num_tasks;
+
+    for (int64_t t = 0; t < num_tasks; ++t) {
+        int64_t start = t * grain;
+        int64_t end = std::min(start + grain, n);
+        submit([&func, &latch, start, end] {
+            for (int64_t i = start; i < end; ++i) {
+                func(i);
+            }
+            std::lock_guard<std::mutex> lock(latch.lock);
+            if (--latch.remaining == 0) {
+                latch.cv.notify_all();
+            }
+        });
     }
 
-    //pthread joining
-    for (t = 0; t < core->opt.num_thread; t++) {
-        int ret = pthread_join(tids[t], NULL);
-        NEG_CHK(ret);
+    //help out instead of blocking while there is queued work (which may include our own tasks)
+    std::function<void()> task;
+    while (latch.remaining > 0) {
+        if (pop_task(task)) {
+            task();
+            task = nullptr;
+        } else {
+            std::unique_lock<std::mutex> lock(latch.lock);
+            latch.cv.wait_for(lock, std::chrono::milliseconds(1), [&latch] { return latch.remaining == 0; });
+        }
     }
+    //the last task may still hold the latch lock while notifying
+    std::lock_guard<std::mutex> lock(latch.lock);
 }
 
 /* process all reads in the given batch db */
@@ -135,6 +182,10 @@ void work_db(core_t* core, db_t* db, void (*func)(core_t*,db_t*,int)){
     }
 
     else {
-        pthread_db(core,db,func);
+        //several tasks per worker so that stealing can even out reads of very different lengths
+        int64_t grain = db->n_rec / (core->opt.num_thread * 16);
+        core->pool->parallel_for(db->n_rec, grain, [core, db, func](int64_t i) {
+            func(core, db, (int)i);
+        });
     }
 }
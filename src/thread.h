@@ -0,0 +1,62 @@
+/* @file thread.h
+**
+** persistent work-stealing thread pool shared by the processing stages
+** @@
+******************************************************************************/
+
+#ifndef THREAD_H
+#define THREAD_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* A fixed set of worker threads created once and reused for every batch. Each worker owns a deque:
+ * it pushes and pops its own work at the back and idle workers steal from the front of the others.
+ * Any thread may submit closures. parallel_for() blocks until done, and the waiting thread runs
+ * queued tasks itself, so it is safe to call from inside a task. */
+class ThreadPool {
+public:
+    // with cpus the workers are pinned to them (one NUMA node)
+    explicit ThreadPool(int num_threads, const std::vector<int> &cpus = std::vector<int>());
+    ~ThreadPool();
+
+    // queue a closure for asynchronous execution
+    void submit(std::function<void()> task);
+
+    // run func(i) for every i in [0, n), grain consecutive indices per task, and wait for all of them
+    void parallel_for(int64_t n, int64_t grain, const std::function<void(int64_t)> &func);
+
+    int size() const { return (int)m_threads.size(); }
+
+private:
+    struct Worker {
+        std::deque<std::function<void()>> tasks;
+        std::mutex lock;
+    };
+
+    bool pop_task(std::function<void()> &task);
+    void worker_loop(int idx);
+
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::vector<std::thread> m_threads;
+    std::vector<int> m_cpus;
+
+    std::atomic<int64_t> m_queued;      // tasks sitting in any deque
+    std::atomic<uint32_t> m_next_worker; // round robin target for submissions from outside the pool
+    std::mutex m_sleep_lock;
+    std::condition_variable m_sleep_cv;
+    bool m_terminate;
+
+    static thread_local int t_worker_idx; // index of the calling worker, -1 if not a pool thread
+    static thread_local const ThreadPool *t_pool;
+};
+
+#endif
@@ -0,0 +1,92 @@
+/* @file topology.cpp
+**
+** NUMA topology from /sys/devices/system/node and thread pinning
+** @@
+******************************************************************************/
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "topology.h"
+#include "error.h"
+
+/* parse a sysfs cpu list such as 0-15,32-47 */
+static std::vector<int> parse_cpulist(const char *list) {
+    std::vector<int> cpus;
+    const char *p = list;
+    while (*p != '\0' && *p != '\n') {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            p = end;
+        }
+        for (long c = first; c <= last; ++c) {
+            cpus.push_back((int)c);
+        }
+        if (*p == ',') {
+            p++;
+        }
+    }
+    return cpus;
+}
+
+std::vector<std::vector<int>> numa_node_cpus() {
+    std::vector<std::vector<int>> nodes;
+
+    DIR *dir = opendir("/sys/devices/system/node");
+    if (dir == NULL) {
+        return nodes;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        int node;
+        if (sscanf(entry->d_name, "node%d", &node) != 1) {
+            continue;
+        }
+        char path[256];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", entry->d_name);
+        FILE *fp = fopen(path, "r");
+        if (fp == NULL) {
+            continue;
+        }
+        char list[4096];
+        if (fgets(list, sizeof(list), fp) != NULL) {
+            if ((size_t)node >= nodes.size()) {
+                nodes.resize(node + 1);
+            }
+            nodes[node] = parse_cpulist(list);
+        }
+        fclose(fp);
+    }
+    closedir(dir);
+
+    //memory only nodes have no cpus
+    nodes.erase(std::remove_if(nodes.begin(), nodes.end(), [](const std::vector<int> &cpus) { return cpus.empty(); }), nodes.end());
+    return nodes;
+}
+
+void pin_thread(const std::vector<int> &cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu: cpus) {
+        if (cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (ret != 0) {
+        WARNING("Could not pin a thread to its NUMA node: %s", strerror(ret));
+    }
+}
@@ -0,0 +1,18 @@
+/* @file topology.h
+**
+** NUMA topology from /sys/devices/system/node and thread pinning
+** @@
+******************************************************************************/
+
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <vector>
+
+/* online cpus of each NUMA node (by node number), empty if the kernel exposes no NUMA information */
+std::vector<std::vector<int>> numa_node_cpus();
+
+/* restrict the calling thread to cpus; threads it creates afterwards (e.g. OpenMP teams) inherit this */
+void pin_thread(const std::vector<int> &cpus);
+
+#endif
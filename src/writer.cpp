@@ -38,6 +38,8 @@ void write_to_file(FILE *out, char *sequence, char *qstring, char *read_id, bool
         fprintf(out, "+\n");
         fprintf(out, "%s\n", qstring);
     } else {
-        // todo: samline outuput
+        // FASTA, the qstring is not computed
+        fprintf(out, ">%s\n", read_id);
+        fprintf(out, "%s\n", sequence);
     }
 }
\ No newline at end of file
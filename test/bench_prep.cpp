@@ -0,0 +1,92 @@
+/* @file bench_prep.cpp
+**
+** microbenchmark of the signal preprocessing: the tensor path against the single pass one
+** usage: bench_prep [num_reads] [chunk_size]
+** @@
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <random>
+#include <vector>
+
+#include "dorado/signal_prep.h"
+
+static double realtime(void) {
+    struct timeval tp;
+    gettimeofday(&tp, NULL);
+    return tp.tv_sec + tp.tv_usec * 1e-6;
+}
+
+int main(int argc, char *argv[]) {
+    int num_reads = argc > 1 ? atoi(argv[1]) : 2000;
+    int chunk_size = argc > 2 ? atoi(argv[2]) : 8000;
+    const int overlap = 500;
+
+    // synthetic reads: log-normal lengths around 20 kb, an adapter-like step at the start
+    std::mt19937 gen(1);
+    std::lognormal_distribution<double> length(log(20000.0), 0.8);
+    std::normal_distribution<float> noise(0.0f, 60.0f);
+    std::vector<std::vector<int16_t>> signals(num_reads);
+    std::vector<slow5_rec_t> recs(num_reads);
+    uint64_t total_samples = 0;
+    for (int r = 0; r < num_reads; ++r) {
+        size_t len = 1000 + (size_t)length(gen);
+        signals[r].resize(len);
+        for (size_t i = 0; i < len; ++i) {
+            signals[r][i] = (int16_t)(500 + noise(gen) + (i > 200 && i < 1200 ? 300 : 0));
+        }
+        memset(&recs[r], 0, sizeof(slow5_rec_t));
+        recs[r].raw_signal = signals[r].data();
+        recs[r].len_raw_signal = len;
+        recs[r].range = 1400.0;
+        recs[r].digitisation = 2048.0;
+        recs[r].offset = 5.0;
+        total_samples += len;
+    }
+
+    // the runner batch the chunks are copied into
+    std::vector<float> batch(chunk_size);
+    double checksum[2] = {0, 0};
+
+    double t0 = realtime();
+    for (int r = 0; r < num_reads; ++r) {
+        slow5_rec_t *rec = &recs[r];
+        torch::Tensor signal = tensor_from_record(rec).to(torch::kCPU);
+        scale_signal(signal, rec->range / rec->digitisation, rec->offset);
+        std::vector<Chunk *> chunks = chunks_from_tensor(signal, chunk_size, overlap);
+        std::vector<torch::Tensor> tensors = tensor_as_chunks(signal, chunks, chunk_size);
+        torch::Tensor slot = torch::from_blob(batch.data(), {chunk_size});
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            slot.copy_(tensors[i]);
+            checksum[0] += batch[0];
+            delete chunks[i];
+        }
+    }
+    double t_tensor = realtime() - t0;
+
+    t0 = realtime();
+    for (int r = 0; r < num_reads; ++r) {
+        read_signal_t signal = read_signal_from_record(&recs[r]);
+        std::vector<Chunk *> chunks = chunks_from_signal(signal.len, chunk_size, overlap);
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            copy_chunk(signal, chunks[i]->input_offset, chunk_size, batch.data());
+            checksum[1] += batch[0];
+            delete chunks[i];
+        }
+    }
+    double t_single = realtime() - t0;
+
+    fprintf(stderr, "reads: %d, samples: %.1f M, chunk size: %d\n", num_reads, total_samples / 1e6, chunk_size);
+    fprintf(stderr, "tensor path:  %8.3f sec  %8.2f us/read  %8.1f Msamples/s\n", t_tensor,
+            t_tensor * 1e6 / num_reads, total_samples / t_tensor / 1e6);
+    fprintf(stderr, "single pass:  %8.3f sec  %8.2f us/read  %8.1f Msamples/s\n", t_single,
+            t_single * 1e6 / num_reads, total_samples / t_single / 1e6);
+    fprintf(stderr, "speedup: %.1fx, outputs %s\n", t_tensor / t_single,
+            checksum[0] == checksum[1] ? "match" : "DIFFER");
+
+    return checksum[0] == checksum[1] ? EXIT_SUCCESS : EXIT_FAILURE;
+}
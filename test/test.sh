@@ -38,14 +38,70 @@ download_minimap2 () {
     rm minimap2-2.24_x64-linux.tar.bz2
 }
 
+# mean of the qscores of a FASTQ file
+mean_qscore () {
+    awk 'BEGIN { for (i = 33; i < 127; i++) q[sprintf("%c", i)] = i - 33 }
+         NR % 4 == 0 { for (i = 1; i <= length($0); i++) { s += q[substr($0, i, 1)]; n++ } }
+         END { if (n > 0) printf "%.3f\n", s / n }' "$1"
+}
+
 test -d models/dna_r10.4.1_e8.2_400bps_fast@v4.0.0 || download_model
 test -e minimap2/minimap2 || download_minimap2
 
 # echo "Test 1"
-ex  ./slorado basecaller models/dna_r10.4.1_e8.2_400bps_fast@v4.0.0 test/oneread_r10.blow5 --device cpu > test/tmp.fastq  || die "Running the tool failed"
+ex  ./slorado basecaller models/dna_r10.4.1_e8.2_400bps_fast@v4.0.0 test/oneread_r10.blow5 --device cpu > test/tmp.fastq 2> >(tee test/tmp.log >&2) || die "Running the tool failed"
 minimap2/minimap2 -cx map-ont test/chr4_90700000_90900000.fa test/tmp.fastq --secondary=no > test/tmp.paf || die "minimap2 failed"
 awk '{print $10/$11}' test/tmp.paf | datamash mean 1 sstdev 1 q1 1 median 1 q3 1 || die "datamash failed"
 # diff -q test/example.exp test/tmp.txt || die "diff failed"
 
+# echo "Test 2"
+ex  ./slorado basecaller models/dna_r10.4.1_e8.2_400bps_fast@v4.0.0 test/oneread_r10.blow5 --device cpu --check-cpu-lstm=yes > /dev/null || die "CPU LSTM check failed"
+
+# echo "Test 3"
+# int8 LSTM accuracy against the fp32 run of Test 1, mean identity may drop by at most 0.005
+ex  ./slorado basecaller models/dna_r10.4.1_e8.2_400bps_fast@v4.0.0 test/oneread_r10.blow5 --device cpu --cpu-lstm int8 --check-cpu-lstm=yes > test/tmp_int8.fastq  || die "Running the tool with --cpu-lstm int8 failed"
+minimap2/minimap2 -cx map-ont test/chr4_90700000_90900000.fa test/tmp_int8.fastq --secondary=no > test/tmp_int8.paf || die "minimap2 failed"
+awk '{print $10/$11}' test/tmp_int8.paf | datamash mean 1 sstdev 1 q1 1 median 1 q3 1 || die "datamash failed"
+FP32_IDENTITY=$(awk '{print $10/$11}' test/tmp.paf | datamash mean 1)
+INT8_IDENTITY=$(awk '{print $10/$11}' test/tmp_int8.paf | datamash mean 1)
+awk -v a="$FP32_IDENTITY" -v b="$INT8_IDENTITY" 'BEGIN { exit !(b >= a - 0.005) }' || die "int8 LSTM identity $INT8_IDENTITY too far below fp32 $FP32_IDENTITY"
+
+# echo "Test 4"
+# read tails in shorter chunks, mean identity may drop by at most 0.005
+ex  ./slorado basecaller models/dna_r10.4.1_e8.2_400bps_fast@v4.0.0 test/oneread_r10.blow5 --device cpu --chunk-buckets 2000,4000 > test/tmp_buckets.fastq  || die "Running the tool with --chunk-buckets failed"
+minimap2/minimap2 -cx map-ont test/chr4_90700000_90900000.fa test/tmp_buckets.fastq --secondary=no > test/tmp_buckets.paf || die "minimap2 failed"
+BUCKETS_IDENTITY=$(awk '{print $10/$11}' test/tmp_buckets.paf | datamash mean 1)
+awk -v a="$FP32_IDENTITY" -v b="$BUCKETS_IDENTITY" 'BEGIN { exit !(b >= a - 0.005) }' || die "chunk bucket identity $BUCKETS_IDENTITY too far below $FP32_IDENTITY"
+
+# echo "Test 5"
+# the dataflow engine basecalls the same chunks in the same batches as Test 1
+ex  ./slorado basecaller models/dna_r10.4.1_e8.2_400bps_fast@v4.0.0 test/oneread_r10.blow5 --device cpu --dataflow=yes > test/tmp_dataflow.fastq  || die "Running the tool with --dataflow=yes failed"
+diff -q test/tmp.fastq test/tmp_dataflow.fastq || die "dataflow output differs from the batched output"
+
+# echo "Test 6"
+# a packed model gives the same output as its directory
+ex  ./slorado pack-model models/dna_r10.4.1_e8.2_400bps_fast@v4.0.0 test/tmp_model.slm || die "Packing the model failed"
+ex  ./slorado pack-model --check test/tmp_model.slm || die "Checking the packed model failed"
+ex  ./slorado basecaller test/tmp_model.slm test/oneread_r10.blow5 --device cpu > test/tmp_packed.fastq  || die "Running the tool with a packed model failed"
+diff -q test/tmp.fastq test/tmp_packed.fastq || die "packed model output differs from the model directory"
+
+
+# echo "Test 7"
+# int8 scores against the fp32 scores of Test 1, mean identity may drop by at most 0.005
+ex  ./slorado basecaller models/dna_r10.4.1_e8.2_400bps_fast@v4.0.0 test/oneread_r10.blow5 --device cpu --int8-scores=yes > test/tmp_int8_scores.fastq  || die "Running the tool with --int8-scores=yes failed"
+minimap2/minimap2 -cx map-ont test/chr4_90700000_90900000.fa test/tmp_int8_scores.fastq --secondary=no > test/tmp_int8_scores.paf || die "minimap2 failed"
+INT8_SCORES_IDENTITY=$(awk '{print $10/$11}' test/tmp_int8_scores.paf | datamash mean 1)
+echo "int8 scores: mean identity $INT8_SCORES_IDENTITY (fp32 $FP32_IDENTITY), mean qscore $(mean_qscore test/tmp_int8_scores.fastq) (fp32 $(mean_qscore test/tmp.fastq))"
+awk -v a="$FP32_IDENTITY" -v b="$INT8_SCORES_IDENTITY" 'BEGIN { exit !(b >= a - 0.005) }' || die "int8 scores identity $INT8_SCORES_IDENTITY too far below fp32 $FP32_IDENTITY"
+
+# echo "Test 8"
+# FASTA output skips the qscores, the sequences are those of Test 1
+ex  ./slorado basecaller models/dna_r10.4.1_e8.2_400bps_fast@v4.0.0 test/oneread_r10.blow5 --device cpu --emit-fastq=no > test/tmp.fasta 2> test/tmp_fasta.log || die "Running the tool with --emit-fastq=no failed"
+diff -q <(awk 'NR%4==2' test/tmp.fastq) <(awk 'NR%2==0' test/tmp.fasta) || die "FASTA sequences differ from the FASTQ sequences"
+# the stage timers of the FASTQ run of Test 1 and of the FASTA run
+for log in test/tmp.log test/tmp_fasta.log; do
+    echo "$log:"
+    grep -E "Data processing time|Decode time|Postprocess time|Data output time: [0-9.]* sec :" "$log"
+done
 
 echo "Tests passed"
\ No newline at end of file
@@ -3,6 +3,8 @@
 
 #include <torch/torch.h>
 
+class ThreadPool;
+
 class CPUDecoder final : Decoder {
 public:
     std::vector<DecodedChunk> beam_search(const torch::Tensor& scores,
@@ -12,8 +14,17 @@ public:
     constexpr static torch::ScalarType dtype = torch::kF32;
 };
 
+// Decodes the first num_chunks chunks of scores [N, T, C]. Chunks are handed out one at a time to
+// the threads of pool, or decoded on the calling thread if pool is NULL.
+// int8 scores (from quantise_scores) are decoded as q * score_scale.
 std::vector<DecodedChunk> beam_search_cpu(const torch::Tensor& scores,
                                           int num_chunks,
                                           const DecoderOptions& options,
-                                          std::string &device);
+                                          std::string &device,
+                                          ThreadPool *pool = nullptr,
+                                          float score_scale = 1.0f);
+
+// Quantises the scores of a batch to int8 with one scale for the whole batch, q = round(x / scale)
+// with scale = max|x| / 127, and returns them with the scale in *score_scale. scores is overwritten.
+torch::Tensor quantise_scores(torch::Tensor scores, float *score_scale);
 
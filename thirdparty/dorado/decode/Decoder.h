@@ -19,6 +19,9 @@ struct DecoderOptions {
     float q_scale = 1.0;
     float temperature = 1.0;
     bool move_pad = false;
+    // CPU decoder only
+    bool int8_scores = false;  // quantise the scores of each batch to int8 before decoding
+    bool qstring = true;       // compute the qscores, without them only the sequence is decoded
 };
 
 class Decoder {
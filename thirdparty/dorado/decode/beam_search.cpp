@@ -7,11 +7,16 @@
 #include <algorithm>
 #include <array>
 #include <cstring>
+#include <functional>
 #include <iostream>
 #include <limits>
 #include <numeric>
 
-//#define REMOVE_FIXED_BEAM_STAYS
+// The CPU model outputs compact scores, 4 step transitions per state, and the stays get the fixed
+// blank score (as in crf_scan.cpp). The Makefile passes -DREMOVE_FIXED_BEAM_STAYS=1.
+#ifndef REMOVE_FIXED_BEAM_STAYS
+#define REMOVE_FIXED_BEAM_STAYS 1
+#endif
 
 // 16 bit state supports 7-mers with 4 bases.
 typedef int16_t state_t;
@@ -66,8 +71,21 @@ std::tuple<std::string, std::string> generate_sequence(const std::vector<uint8_t
     size_t seqLen = accumulate(moves.begin(), moves.end(), 0);
 
     std::string sequence(seqLen, 'N');
-    std::string qstring(seqLen, '!');
     std::array<char, 4> alphabet = {'A', 'C', 'G', 'T'};
+
+    // no qual data (sequence only): the bases without the qstring
+    if (qual_data.empty()) {
+        for (size_t blk = 0; blk < num_blocks; ++blk) {
+            int base = states[blk] & 3;
+            int move = (blk == 0) ? 1 : int(moves[blk]);
+            for (int j = 0; j < move; ++j) {
+                sequence[seqPos++] = alphabet[base];
+            }
+        }
+        return make_tuple(sequence, std::string());
+    }
+
+    std::string qstring(seqLen, '!');
     std::vector<float> baseProbs(seqLen), totalProbs(seqLen);
 
     for (size_t blk = 0; blk < num_blocks; ++blk) {
@@ -111,7 +129,7 @@ template <typename T>
 float beam_search(const T* const scores,
                   size_t scores_block_stride,
                   const float* const back_guide,
-                  const float* const posts,
+                  const float* const fwd,
                   size_t num_states,
                   size_t num_blocks,
                   size_t max_beam_width,
@@ -145,17 +163,33 @@ float beam_search(const T* const scores,
     std::vector<BeamFrontElement>* current_beam_front = &beam_front_vector_1;
     std::vector<BeamFrontElement>* prev_beam_front = &beam_front_vector_2;
 
+    // Open addressing table of the steps of a block by hash, for merging the stays, at most half full
+    struct HashSlot {
+        uint64_t hash;
+        int32_t elem_idx;  // -1 if empty
+    };
+    size_t step_table_size = 1;
+    while (step_table_size < 2 * num_bases * max_beam_width) {
+        step_table_size *= 2;
+    }
+    const size_t step_table_mask = step_table_size - 1;
+    std::vector<HashSlot> step_table(step_table_size);
+
+    // scores of the candidates of a block, for selecting the top ones
+    std::vector<float> candidate_scores(max_beam_candidates);
+
     // Find the score an initial element needs in order to make it into the beam
-    T beam_init_threshold = std::numeric_limits<T>::lowest();
+    // (the back guides are floats whatever the type of the scores)
+    float beam_init_threshold = std::numeric_limits<float>::lowest();
     if (max_beam_width < num_states) {
         // Copy the first set of back guides and sort to extract max_beam_width highest elements
-        std::vector<T> sorted_back_guides(num_states);
-        memcpy(sorted_back_guides.data(), back_guide, num_states * sizeof(T));
+        std::vector<float> sorted_back_guides(num_states);
+        memcpy(sorted_back_guides.data(), back_guide, num_states * sizeof(float));
 
         // Note we don't need a full sort here to get the max_beam_width highest values
         std::nth_element(sorted_back_guides.begin(),
                          sorted_back_guides.begin() + max_beam_width - 1, sorted_back_guides.end(),
-                         std::greater<T>());
+                         std::greater<float>());
         beam_init_threshold = sorted_back_guides[max_beam_width - 1];
     }
 
@@ -270,65 +304,83 @@ float beam_search(const T* const scores,
                                                        (uint8_t)prev_elem_idx, true};
         }
 
-        // For each new stay, see if any steps result in the same sequence hash, and merge if so
+        // For each new stay, see if any steps result in the same sequence hash, and merge if so.
+        // The steps are indexed by hash, so each stay only visits the steps with its hash. A stay
+        // visits them in the order of the steps and the stays are taken in order, so the merges
+        // (and their rounding) are those of comparing every stay with every step.
+        std::fill(step_table.begin(), step_table.end(), HashSlot{0, -1});
+        const size_t num_steps = num_bases * current_beam_width;
+        for (size_t step_elem_idx = 0; step_elem_idx < num_steps; step_elem_idx++) {
+            const uint64_t hash = (*current_beam_front)[step_elem_idx].hash;
+            size_t slot = hash & step_table_mask;
+            while (step_table[slot].elem_idx >= 0) {
+                slot = (slot + 1) & step_table_mask;
+            }
+            step_table[slot] = {hash, int32_t(step_elem_idx)};
+        }
         for (size_t prev_elem_idx = 0; prev_elem_idx < current_beam_width; prev_elem_idx++) {
             // The index of the stay in the beamfront
-            size_t stay_elem_idx = num_bases * current_beam_width + prev_elem_idx;
+            size_t stay_elem_idx = num_steps + prev_elem_idx;
             // latest base is in smallest bits
             int stay_latest_base = int((*current_beam_front)[stay_elem_idx].state % num_bases);
-
-            // Go through all the possible step extensions that match this destination base with the stay and compare
-            //  their hashes, merging if we find any
-            for (size_t prev_elem_comp_idx = 0; prev_elem_comp_idx < current_beam_width;
-                 prev_elem_comp_idx++) {
-                size_t step_elem_idx = prev_elem_comp_idx * num_bases + stay_latest_base;
-                if ((*current_beam_front)[stay_elem_idx].hash ==
-                    (*current_beam_front)[step_elem_idx].hash) {
-                    if ((*current_beam_front)[stay_elem_idx].score >
-                        (*current_beam_front)[step_elem_idx].score) {
-                        // Fold the step into the stay
-                        (*current_beam_front)[stay_elem_idx].score = log_sum_exp(
-                                (*current_beam_front)[stay_elem_idx].score,
-                                (*current_beam_front)[step_elem_idx].score, temperature);
-                        // The step element will end up last, sorted by score
-                        (*current_beam_front)[step_elem_idx].score =
-                                -std::numeric_limits<float>::max();
-                    } else {
-                        // Fold the stay into the step
-                        (*current_beam_front)[step_elem_idx].score = log_sum_exp(
-                                (*current_beam_front)[stay_elem_idx].score,
-                                (*current_beam_front)[step_elem_idx].score, temperature);
-                        // The stay element will end up last, sorted by score
-                        (*current_beam_front)[stay_elem_idx].score =
-                                -std::numeric_limits<float>::max();
-                    }
+            const uint64_t stay_hash = (*current_beam_front)[stay_elem_idx].hash;
+
+            // Linear probing without deletions finds equal hashes in the order they were added
+            for (size_t slot = stay_hash & step_table_mask; step_table[slot].elem_idx >= 0;
+                 slot = (slot + 1) & step_table_mask) {
+                const size_t step_elem_idx = size_t(step_table[slot].elem_idx);
+                // only the steps that append the latest base of the stay are compared
+                if (step_table[slot].hash != stay_hash ||
+                    step_elem_idx % num_bases != size_t(stay_latest_base)) {
+                    continue;
+                }
+                if ((*current_beam_front)[stay_elem_idx].score >
+                    (*current_beam_front)[step_elem_idx].score) {
+                    // Fold the step into the stay
+                    (*current_beam_front)[stay_elem_idx].score = log_sum_exp(
+                            (*current_beam_front)[stay_elem_idx].score,
+                            (*current_beam_front)[step_elem_idx].score, temperature);
+                    // The step element will end up last, sorted by score
+                    (*current_beam_front)[step_elem_idx].score = -std::numeric_limits<float>::max();
+                } else {
+                    // Fold the stay into the step
+                    (*current_beam_front)[step_elem_idx].score = log_sum_exp(
+                            (*current_beam_front)[stay_elem_idx].score,
+                            (*current_beam_front)[step_elem_idx].score, temperature);
+                    // The stay element will end up last, sorted by score
+                    (*current_beam_front)[stay_elem_idx].score = -std::numeric_limits<float>::max();
                 }
             }
         }
 
-        // There are now `new_elem_count` elements in the list.  Let's get the max
-        float max_score = -std::numeric_limits<float>::max();
+        // Only the counts up to max_beam_width + 1 matter below (more is just "too many"), so the
+        // max_beam_width + 1 highest scores are selected and sorted once, and each count is a binary
+        // search in them instead of a pass over all the candidates.
+        const size_t num_top = std::min(max_beam_width + 1, new_elem_count);
         for (size_t elem_idx = 0; elem_idx < new_elem_count; elem_idx++) {
-            if ((*current_beam_front)[elem_idx].score > max_score)
-                max_score = (*current_beam_front)[elem_idx].score;
+            candidate_scores[elem_idx] = (*current_beam_front)[elem_idx].score;
         }
+        std::partial_sort(candidate_scores.begin(), candidate_scores.begin() + num_top,
+                          candidate_scores.begin() + new_elem_count, std::greater<float>());
+
+        // There are now `new_elem_count` elements in the list.  The max is the first of the top scores
+        float max_score = candidate_scores[0];
 
         // Starting point for finding the cutoff score is the beam cut score
         float beam_cutoff_score = max_score - log_beam_cut;
 
-        auto get_elem_count = [](const std::vector<BeamFrontElement>* current_beam_front,
-                                 size_t new_elem_count, float beam_score) {
-            // Count the elements which meet the beam score
-            size_t count = 0;
-            for (size_t elem_idx = 0; elem_idx < new_elem_count; elem_idx++) {
-                if ((*current_beam_front)[elem_idx].score >= beam_score)
-                    count++;
-            }
-            return count;
+        // Count the elements which meet the beam score, exact up to max_beam_width + 1
+        auto get_elem_count = [&candidate_scores, num_top](float beam_score) {
+            return size_t(std::partition_point(candidate_scores.begin(),
+                                               candidate_scores.begin() + num_top,
+                                               [beam_score](float score) {
+                                                   return score >= beam_score;
+                                               }) -
+                          candidate_scores.begin());
         };
 
         // Count the elements which meet the min score
-        size_t elem_count = get_elem_count(current_beam_front, new_elem_count, beam_cutoff_score);
+        size_t elem_count = get_elem_count(beam_cutoff_score);
 
         if (elem_count > max_beam_width) {
             // Need to find a score which doesn't return too many scores, but doesn't reduce beam width too much
@@ -349,7 +401,7 @@ float beam_search(const T* const scores,
                     hi_score = beam_cutoff_score;
                     beam_cutoff_score = (beam_cutoff_score + low_score) / 2.0f;  // binary search.
                 }
-                elem_count = get_elem_count(current_beam_front, new_elem_count, beam_cutoff_score);
+                elem_count = get_elem_count(beam_cutoff_score);
                 num_guesses++;
             }
             // If we made 10 guesses and didn't find a suitable score, a couple of things may have happened:
@@ -361,7 +413,7 @@ float beam_search(const T* const scores,
             //  - in this case we should just take the hi_score and accept it will return us less than 80% of the beam
             if (num_guesses == MAX_GUESSES) {
                 beam_cutoff_score = hi_score;
-                elem_count = get_elem_count(current_beam_front, new_elem_count, beam_cutoff_score);
+                elem_count = get_elem_count(beam_cutoff_score);
             }
         }
         // Clamp the element count to the max beam width in case of failure 2 from above.
@@ -421,6 +473,25 @@ float beam_search(const T* const scores,
     hp_states[1] = hp_states[3] / 3;     // calculate hp C from hp T (01b per base)
     hp_states[2] = hp_states[1] * 2;     // calculate hp G from hp C (10b per base)
 
+    // Without forward scores only the sequence is wanted: no qual data
+    if (fwd == nullptr) {
+        for (size_t block_idx = 0; block_idx < num_blocks; block_idx++) {
+            states[block_idx] = states[block_idx] % num_bases;
+        }
+        qual_data.clear();
+        return final_score;
+    }
+
+    // The posterior of state s at block t is exp(fwd[t][s] + bwd[t][s] - log Z). Every path goes
+    // through one state per block, so the normaliser is the same log Z = logsumexp(fwd[T]) for all t.
+    const float* const last_fwd = fwd + num_blocks * num_states;
+    const float max_fwd = *std::max_element(last_fwd, last_fwd + num_states);
+    float sum_z = 0.0f;
+    for (size_t state = 0; state < num_states; state++) {
+        sum_z += expf(last_fwd[state] - max_fwd);
+    }
+    const float log_z = max_fwd + logf(sum_z);
+
     // Compute per-base qual data
     for (size_t block_idx = 0; block_idx < num_blocks; block_idx++) {
         int state = states[block_idx];
@@ -429,24 +500,30 @@ float beam_search(const T* const scores,
 
         // Compute a probability for this block, based on the path kmer. See the following explanation:
         // https://git.oxfordnanolabs.local/machine-learning/notebooks/-/blob/master/bonito-basecaller-qscores.ipynb
-        const float* timestep_posts = posts + ((block_idx + 1) * num_states);
+        // Only these 9 posteriors are needed, so they are computed here from the forward and
+        // backward scores instead of a softmax over all the states of every block.
+        const float* timestep_fwd = fwd + ((block_idx + 1) * num_states);
+        const float* timestep_bwd = back_guide + ((block_idx + 1) * num_states);
+        const auto timestep_posts = [timestep_fwd, timestep_bwd, log_z](int s) {
+            return expf(timestep_fwd[s] + timestep_bwd[s] - log_z);
+        };
 
         // For states which are homopolymers, we don't want to count the states more than once
         bool is_hp = state == hp_states[0] || state == hp_states[1] || state == hp_states[2] ||
                      state == hp_states[3];
-        float block_prob = float(timestep_posts[state]) * (is_hp ? -1.0f : 1.0f);
+        float block_prob = timestep_posts(state) * (is_hp ? -1.0f : 1.0f);
 
         // Add in left-shifted kmers
         int l_shift_idx = state / num_bases;
         int msb = int(num_states) / num_bases;
         for (int shift_base = 0; shift_base < num_bases; shift_base++) {
-            block_prob += float(timestep_posts[l_shift_idx + msb * shift_base]);
+            block_prob += timestep_posts(l_shift_idx + msb * shift_base);
         }
 
         // Add in the right-shifted kmers
         int r_shift_idx = (state * num_bases) % num_states;
         for (int shift_base = 0; shift_base < num_bases; shift_base++) {
-            block_prob += float(timestep_posts[r_shift_idx + shift_base]);
+            block_prob += timestep_posts(r_shift_idx + shift_base);
         }
         if (block_prob < 0.0f) block_prob = 0.0f;
         else if (block_prob > 1.0f) block_prob = 1.0f;\
@@ -467,7 +544,7 @@ float beam_search(const T* const scores,
 std::tuple<std::string, std::string, std::vector<uint8_t>> beam_search_decode(
         const torch::Tensor& scores_t,
         const torch::Tensor& back_guides_t,
-        const torch::Tensor& posts_t,
+        const torch::Tensor& fwd_t,
         size_t beam_width,
         float beam_cut,
         float fixed_stay_score,
@@ -483,33 +560,31 @@ std::tuple<std::string, std::string, std::vector<uint8_t>> beam_search_decode(
     std::vector<uint8_t> moves(num_blocks);
     std::vector<float> qual_data(num_blocks * num_bases);
 
-    // Posterior probabilities and back guides must be floats regardless of scores type.
-    if (posts_t.dtype() != torch::kFloat32 || back_guides_t.dtype() != torch::kFloat32) {
+    // Forward scores and back guides must be floats regardless of scores type.
+    if (fwd_t.dtype() != torch::kFloat32 || back_guides_t.dtype() != torch::kFloat32) {
         throw std::runtime_error(
-                "beam_search_decode: mismatched tensor types provided for posts and "
+                "beam_search_decode: mismatched tensor types provided for forward scores and "
                 "guides");
     }
 
-    // back guides and posts should be contiguous
+    // back guides and forward scores should be contiguous
     auto back_guides_contig = back_guides_t.expect_contiguous();
-    auto posts_contig = posts_t.expect_contiguous();
+    auto fwd_contig = fwd_t.expect_contiguous();
     // scores_t may come from a tensor with chunks interleaved, but make sure the last dimension is contiguous
     auto scores_block_contig = (scores_t.stride(1) == 1) ? scores_t : scores_t.contiguous();
     const size_t scores_block_stride = scores_block_contig.stride(0);
     if (scores_t.dtype() == torch::kFloat32) {
-        const auto scores = scores_block_contig.data_ptr<float>();
-        const auto back_guides = back_guides_contig->data_ptr<float>();
-        const auto posts = posts_contig->data_ptr<float>();
-
-        beam_search<float>(scores, scores_block_stride, back_guides, posts, num_states, num_blocks,
-                           beam_width, beam_cut, fixed_stay_score, states, moves, qual_data,
-                           temperature, 1.0f);
+        return beam_search_decode(scores_block_contig.data_ptr<float>(), scores_block_stride,
+                                  back_guides_contig->data_ptr<float>(),
+                                  fwd_contig->data_ptr<float>(), num_blocks, num_states,
+                                  beam_width, beam_cut, fixed_stay_score, q_shift, q_scale,
+                                  temperature);
     } else if (scores_t.dtype() == torch::kInt8) {
         const auto scores = scores_block_contig.data_ptr<int8_t>();
         const auto back_guides = back_guides_contig->data_ptr<float>();
-        const auto posts = posts_contig->data_ptr<float>();
+        const auto fwd = fwd_contig->data_ptr<float>();
 
-        beam_search<int8_t>(scores, scores_block_stride, back_guides, posts, num_states, num_blocks,
+        beam_search<int8_t>(scores, scores_block_stride, back_guides, fwd, num_states, num_blocks,
                             beam_width, beam_cut, fixed_stay_score, states, moves, qual_data,
                             temperature, byte_score_scale);
     } else {
@@ -521,3 +596,69 @@ std::tuple<std::string, std::string, std::vector<uint8_t>> beam_search_decode(
 
     return std::make_tuple(sequence, qstring, moves);
 }
+
+template <typename T>
+static std::tuple<std::string, std::string, std::vector<uint8_t>> beam_search_decode_raw(
+        const T* scores,
+        size_t scores_block_stride,
+        const float* back_guides,
+        const float* fwd,
+        int num_blocks,
+        int num_states,
+        size_t beam_width,
+        float beam_cut,
+        float fixed_stay_score,
+        float q_shift,
+        float q_scale,
+        float temperature,
+        float score_scale) {
+    std::string sequence, qstring;
+    std::vector<int32_t> states(num_blocks);
+    std::vector<uint8_t> moves(num_blocks);
+    std::vector<float> qual_data(num_blocks * num_bases);
+
+    beam_search<T>(scores, scores_block_stride, back_guides, fwd, num_states, num_blocks,
+                   beam_width, beam_cut, fixed_stay_score, states, moves, qual_data, temperature,
+                   score_scale);
+
+    std::tie(sequence, qstring) = generate_sequence(moves, states, qual_data, q_shift, q_scale);
+
+    return std::make_tuple(sequence, qstring, moves);
+}
+
+std::tuple<std::string, std::string, std::vector<uint8_t>> beam_search_decode(
+        const float* scores,
+        size_t scores_block_stride,
+        const float* back_guides,
+        const float* fwd,
+        int num_blocks,
+        int num_states,
+        size_t beam_width,
+        float beam_cut,
+        float fixed_stay_score,
+        float q_shift,
+        float q_scale,
+        float temperature) {
+    return beam_search_decode_raw(scores, scores_block_stride, back_guides, fwd, num_blocks,
+                                  num_states, beam_width, beam_cut, fixed_stay_score, q_shift,
+                                  q_scale, temperature, 1.0f);
+}
+
+std::tuple<std::string, std::string, std::vector<uint8_t>> beam_search_decode(
+        const int8_t* scores,
+        size_t scores_block_stride,
+        float byte_score_scale,
+        const float* back_guides,
+        const float* fwd,
+        int num_blocks,
+        int num_states,
+        size_t beam_width,
+        float beam_cut,
+        float fixed_stay_score,
+        float q_shift,
+        float q_scale,
+        float temperature) {
+    return beam_search_decode_raw(scores, scores_block_stride, back_guides, fwd, num_blocks,
+                                  num_states, beam_width, beam_cut, fixed_stay_score, q_shift,
+                                  q_scale, temperature, byte_score_scale);
+}
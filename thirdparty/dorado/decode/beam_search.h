@@ -57,14 +57,50 @@ void merge_sort(T* data,
     }
 }
 
+// scores_t: [num_blocks][4 * num_states] step scores in the compact layout of crf_scan.h, the stays
+// all score fixed_stay_score.
 std::tuple<std::string, std::string, std::vector<uint8_t>> beam_search_decode(
         const torch::Tensor& scores_t,
         const torch::Tensor& back_guides_t,
-        const torch::Tensor& posts_t,
+        const torch::Tensor& fwd_t,
         size_t beam_width,
         float beam_cut,
         float fixed_stay_score,
         float q_shift,
         float q_scale,
         float temperature,
-        float byte_score_scale);
\ No newline at end of file
+        float byte_score_scale);
+
+// As above for fp32 scores already in memory, e.g. the buffers filled by crf_scan.h.
+// back_guides and fwd are the backward and forward scores of crf_scan.h, [num_blocks + 1][num_states].
+// The posteriors for the qscores are computed from them only at the states on the decoded path.
+// With fwd NULL no qscores are computed and the qstring is empty.
+std::tuple<std::string, std::string, std::vector<uint8_t>> beam_search_decode(
+        const float* scores,
+        size_t scores_block_stride,
+        const float* back_guides,
+        const float* fwd,
+        int num_blocks,
+        int num_states,
+        size_t beam_width,
+        float beam_cut,
+        float fixed_stay_score,
+        float q_shift,
+        float q_scale,
+        float temperature);
+
+// As above for int8 scores, score = q * byte_score_scale.
+std::tuple<std::string, std::string, std::vector<uint8_t>> beam_search_decode(
+        const int8_t* scores,
+        size_t scores_block_stride,
+        float byte_score_scale,
+        const float* back_guides,
+        const float* fwd,
+        int num_blocks,
+        int num_states,
+        size_t beam_width,
+        float beam_cut,
+        float fixed_stay_score,
+        float q_shift,
+        float q_scale,
+        float temperature);
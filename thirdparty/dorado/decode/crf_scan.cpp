@@ -0,0 +1,256 @@
+#include "crf_scan.h"
+
+#include "../utils/simd.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+/******************************* score rows *******************************/
+
+// The kernels read the scores one timestep at a time through these: fp32 rows are used in place,
+// int8 rows are dequantised into a row buffer that stays in cache.
+
+static void dequantise_row_scalar(const int8_t *q, int C, float scale, float *out) {
+    for (int i = 0; i < C; ++i) {
+        out[i] = q[i] * scale;
+    }
+}
+
+SIMD_AVX2 static void dequantise_row_avx2(const int8_t *q, int C, float scale, float *out) {
+    const __m256 scale_v = _mm256_set1_ps(scale);
+    int i = 0;
+    for (; i + 8 <= C; i += 8) {
+        __m256i v = _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)(q + i)));
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale_v));
+    }
+    dequantise_row_scalar(q + i, C - i, scale, out + i);
+}
+
+struct F32Rows {
+    const float *scores;
+    size_t stride;
+    const float *row(int t) const { return scores + t * stride; }
+};
+
+struct I8Rows {
+    const int8_t *scores;
+    size_t stride;
+    int C;
+    float scale;
+    bool avx2;
+    float *buf;
+    const float *row(int t) const {
+        if (avx2) {
+            dequantise_row_avx2(scores + t * stride, C, scale, buf);
+        } else {
+            dequantise_row_scalar(scores + t * stride, C, scale, buf);
+        }
+        return buf;
+    }
+};
+
+/********************************** scalar **********************************/
+
+static inline float lse5(float a, float b, float c, float d, float e) {
+    float m = std::max(std::max(std::max(a, b), std::max(c, d)), e);
+    return m + logf(expf(a - m) + expf(b - m) + expf(c - m) + expf(d - m) + expf(e - m));
+}
+
+template <typename Rows>
+static void forward_scan_scalar(const Rows &rows,
+                                int T,
+                                int S,
+                                float stay,
+                                float *fwd) {
+    const int Q = S / 4;
+    for (int t = 0; t < T; ++t) {
+        const float *prev = fwd + (size_t)t * S;
+        const float *m = rows.row(t);
+        float *cur = fwd + (size_t)(t + 1) * S;
+        for (int s = 0; s < S; ++s) {
+            const int p = s / 4;
+            cur[s] = lse5(prev[s] + stay, prev[p] + m[s * 4], prev[Q + p] + m[s * 4 + 1],
+                          prev[2 * Q + p] + m[s * 4 + 2], prev[3 * Q + p] + m[s * 4 + 3]);
+        }
+    }
+}
+
+template <typename Rows>
+static void backward_scan_scalar(const Rows &rows,
+                                 int T,
+                                 int S,
+                                 float stay,
+                                 float *bwd) {
+    const int Q = S / 4;
+    for (int t = T - 1; t >= 0; --t) {
+        const float *next = bwd + (size_t)(t + 1) * S;
+        const float *m = rows.row(t);
+        float *cur = bwd + (size_t)t * S;
+        for (int s = 0; s < S; ++s) {
+            // successors of s drop its first base and append b
+            const int n = (s % Q) * 4;
+            const int j = s / Q;
+            cur[s] = lse5(next[s] + stay, next[n] + m[n * 4 + j], next[n + 1] + m[(n + 1) * 4 + j],
+                          next[n + 2] + m[(n + 2) * 4 + j], next[n + 3] + m[(n + 3) * 4 + j]);
+        }
+    }
+}
+
+/*********************************** AVX2 ***********************************/
+
+SIMD_AVX2 static inline __m256 lse5_avx2(__m256 a, __m256 b, __m256 c, __m256 d, __m256 e) {
+    __m256 m = _mm256_max_ps(_mm256_max_ps(_mm256_max_ps(a, b), _mm256_max_ps(c, d)), e);
+    __m256 sum = exp256_ps(_mm256_sub_ps(a, m));
+    sum = _mm256_add_ps(sum, exp256_ps(_mm256_sub_ps(b, m)));
+    sum = _mm256_add_ps(sum, exp256_ps(_mm256_sub_ps(c, m)));
+    sum = _mm256_add_ps(sum, exp256_ps(_mm256_sub_ps(d, m)));
+    sum = _mm256_add_ps(sum, exp256_ps(_mm256_sub_ps(e, m)));
+    return _mm256_add_ps(m, log256_ps(sum));
+}
+
+// Splits 32 floats p[4 * i + k] (i < 8, k < 4) into out[k] = {p[k], p[4 + k], ..., p[28 + k]}.
+SIMD_AVX2 static inline void deinterleave4_avx2(const float *p, __m256 out[4]) {
+    __m256 r0 = _mm256_loadu_ps(p);
+    __m256 r1 = _mm256_loadu_ps(p + 8);
+    __m256 r2 = _mm256_loadu_ps(p + 16);
+    __m256 r3 = _mm256_loadu_ps(p + 24);
+    __m256 t0 = _mm256_unpacklo_ps(r0, r1);
+    __m256 t1 = _mm256_unpackhi_ps(r0, r1);
+    __m256 t2 = _mm256_unpacklo_ps(r2, r3);
+    __m256 t3 = _mm256_unpackhi_ps(r2, r3);
+    // the shuffles leave the elements in the order i = 0 2 4 6 | 1 3 5 7
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    out[0] = _mm256_permutevar8x32_ps(_mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0)), order);
+    out[1] = _mm256_permutevar8x32_ps(_mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2)), order);
+    out[2] = _mm256_permutevar8x32_ps(_mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0)), order);
+    out[3] = _mm256_permutevar8x32_ps(_mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2)), order);
+}
+
+template <typename Rows>
+SIMD_AVX2 static void forward_scan_avx2(const Rows &rows,
+                                        int T,
+                                        int S,
+                                        float stay,
+                                        float *fwd) {
+    const int Q = S / 4;
+    const __m256 stay_v = _mm256_set1_ps(stay);
+    for (int t = 0; t < T; ++t) {
+        const float *prev = fwd + (size_t)t * S;
+        const float *m = rows.row(t);
+        float *cur = fwd + (size_t)(t + 1) * S;
+        for (int s = 0; s < S; s += 8) {
+            // states s .. s + 3 share the predecessors of s / 4, states s + 4 .. s + 7 those of s / 4 + 1
+            __m256 step[4];
+            deinterleave4_avx2(m + s * 4, step);
+            for (int j = 0; j < 4; ++j) {
+                const float *p = prev + j * Q + s / 4;
+                __m256 pred = _mm256_set_m128(_mm_set1_ps(p[1]), _mm_set1_ps(p[0]));
+                step[j] = _mm256_add_ps(pred, step[j]);
+            }
+            __m256 x_stay = _mm256_add_ps(_mm256_loadu_ps(prev + s), stay_v);
+            _mm256_storeu_ps(cur + s, lse5_avx2(x_stay, step[0], step[1], step[2], step[3]));
+        }
+    }
+}
+
+template <typename Rows>
+SIMD_AVX2 static void backward_scan_avx2(const Rows &rows,
+                                         int T,
+                                         int S,
+                                         float stay,
+                                         float *bwd) {
+    const int Q = S / 4;
+    const __m256 stay_v = _mm256_set1_ps(stay);
+    const __m256i gather_idx = _mm256_setr_epi32(0, 16, 32, 48, 64, 80, 96, 112);
+    for (int t = T - 1; t >= 0; --t) {
+        const float *next = bwd + (size_t)(t + 1) * S;
+        const float *m = rows.row(t);
+        float *cur = bwd + (size_t)t * S;
+        for (int s = 0; s < S; s += 8) {
+            // for the 8 states (all with first base j) the successors are 4 * (s % Q + i) + b
+            const int n = (s % Q) * 4;
+            const int j = s / Q;
+            __m256 step[4];
+            deinterleave4_avx2(next + n, step);
+            for (int b = 0; b < 4; ++b) {
+                __m256 score = _mm256_i32gather_ps(m + n * 4 + b * 4 + j, gather_idx, 4);
+                step[b] = _mm256_add_ps(step[b], score);
+            }
+            __m256 x_stay = _mm256_add_ps(_mm256_loadu_ps(next + s), stay_v);
+            _mm256_storeu_ps(cur + s, lse5_avx2(x_stay, step[0], step[1], step[2], step[3]));
+        }
+    }
+}
+
+/********************************* dispatch *********************************/
+
+static bool use_avx2(int num_states) { return num_states % 32 == 0 && cpu_has_avx2(); }
+
+template <typename Rows>
+static void forward_scan(const Rows &rows, int T, int num_states, float fixed_stay_score, float *fwd) {
+    memset(fwd, 0, num_states * sizeof(float));
+    if (use_avx2(num_states)) {
+        forward_scan_avx2(rows, T, num_states, fixed_stay_score, fwd);
+    } else {
+        forward_scan_scalar(rows, T, num_states, fixed_stay_score, fwd);
+    }
+}
+
+template <typename Rows>
+static void backward_scan(const Rows &rows, int T, int num_states, float fixed_stay_score, float *bwd) {
+    memset(bwd + (size_t)T * num_states, 0, num_states * sizeof(float));
+    if (use_avx2(num_states)) {
+        backward_scan_avx2(rows, T, num_states, fixed_stay_score, bwd);
+    } else {
+        backward_scan_scalar(rows, T, num_states, fixed_stay_score, bwd);
+    }
+}
+
+static I8Rows int8_rows(const int8_t *scores, size_t scores_stride, int num_states, float score_scale) {
+    static thread_local std::vector<float> buf;
+    buf.resize(num_states * 4);
+    return I8Rows{scores, scores_stride, num_states * 4, score_scale, cpu_has_avx2(), buf.data()};
+}
+
+void crf_forward_scan(const float *scores,
+                      size_t scores_stride,
+                      int T,
+                      int num_states,
+                      float fixed_stay_score,
+                      float *fwd) {
+    forward_scan(F32Rows{scores, scores_stride}, T, num_states, fixed_stay_score, fwd);
+}
+
+void crf_backward_scan(const float *scores,
+                       size_t scores_stride,
+                       int T,
+                       int num_states,
+                       float fixed_stay_score,
+                       float *bwd) {
+    backward_scan(F32Rows{scores, scores_stride}, T, num_states, fixed_stay_score, bwd);
+}
+
+void crf_forward_scan(const int8_t *scores,
+                      size_t scores_stride,
+                      float score_scale,
+                      int T,
+                      int num_states,
+                      float fixed_stay_score,
+                      float *fwd) {
+    forward_scan(int8_rows(scores, scores_stride, num_states, score_scale), T, num_states,
+                 fixed_stay_score, fwd);
+}
+
+void crf_backward_scan(const int8_t *scores,
+                       size_t scores_stride,
+                       float score_scale,
+                       int T,
+                       int num_states,
+                       float fixed_stay_score,
+                       float *bwd) {
+    backward_scan(int8_rows(scores, scores_stride, num_states, score_scale), T, num_states,
+                  fixed_stay_score, bwd);
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Forward and backward passes over the CRF of one chunk, for the CPU beam search.
+//
+// scores: [T][C] transition scores with row stride scores_stride, in the compact layout of the
+//         CPU model: C = 4 * num_states and the step into state s from predecessor
+//         j * num_states / 4 + s / 4 is scored at s * 4 + j. Stays have the fixed score.
+// fwd, bwd: [T + 1][num_states], caller owned so they can be reused across chunks.
+//
+// The state loop is vectorised with AVX2 when num_states is a multiple of 32 (state_len >= 3),
+// otherwise a scalar loop is used.
+
+// fwd[0] = 0, fwd[t + 1][s] = logsumexp over the transitions into s of fwd[t] + score
+void crf_forward_scan(const float *scores,
+                      size_t scores_stride,
+                      int T,
+                      int num_states,
+                      float fixed_stay_score,
+                      float *fwd);
+
+// bwd[T] = 0, bwd[t][s] = logsumexp over the transitions out of s of bwd[t + 1] + score
+void crf_backward_scan(const float *scores,
+                       size_t scores_stride,
+                       int T,
+                       int num_states,
+                       float fixed_stay_score,
+                       float *bwd);
+
+// As above for int8 scores (see quantise_scores() in CPUDecoder.h), score = q * score_scale. Each
+// timestep is dequantised into a row buffer before it is scanned, so the scores are read from
+// memory at a quarter of the fp32 traffic.
+void crf_forward_scan(const int8_t *scores,
+                      size_t scores_stride,
+                      float score_scale,
+                      int T,
+                      int num_states,
+                      float fixed_stay_score,
+                      float *fwd);
+
+void crf_backward_scan(const int8_t *scores,
+                       size_t scores_stride,
+                       float score_scale,
+                       int T,
+                       int num_states,
+                       float fixed_stay_score,
+                       float *bwd);
@@ -2,7 +2,9 @@
 #include <string>
 #include <torch/torch.h>
 
+#include <atomic>
 #include <iostream>
+#include <mutex>
 
 #include "../../../src/globals.h"
 #include "../../../src/misc.h"
@@ -10,6 +12,7 @@
 #include "CRFModel.h"
 #include "error.h"
 #include "../utils/tensor_utils.h"
+#include "cpu_lstm.h"
 
 #ifdef USE_CUDA_LSTM
 #include "../utils/cuda_utils.h"
@@ -32,17 +35,41 @@ static bool cuda_lstm_is_quantized(int layer_size) {
 #endif  // if USE_CUDA_LSTM
 
 using namespace torch::nn;
-namespace F = torch::nn::functional;
 using Slice = torch::indexing::Slice;
 using quantized_lstm = std::function<int(void *, void *, void *, void *, void *, void *, int)>;
 
+// Quantize a tensor to int8, returning per-channel scales and the quantized tensor.
+// The tensor is transposed first, so for an LSTM weight_hh [4H, H] the result is [H, 4H] with one
+// scale per gate column. Shared by the CUDA and CPU int8 LSTMs.
+static std::pair<torch::Tensor, torch::Tensor> quantize_tensor(torch::Tensor tensor,
+                                                               int levels = 256) {
+    tensor = tensor.transpose(0, 1).contiguous();
+    auto fp_max = torch::abs(std::get<0>(torch::max(tensor, 0)));
+    auto fp_min = torch::abs(std::get<0>(torch::min(tensor, 0)));
+
+    auto fp_range =
+            std::get<0>(
+                    torch::cat({fp_min.index({torch::indexing::Slice(), torch::indexing::None}),
+                                fp_max.index({torch::indexing::Slice(), torch::indexing::None})},
+                               1)
+                            .max(1)) *
+            2;
+    auto quantization_scale = levels / fp_range;
+    auto quantization_max = (levels / 2) - 1;
+
+    auto tensor_quantized = (tensor * quantization_scale)
+                                    .round()
+                                    .clip(-quantization_max, quantization_max)
+                                    .to(torch::kI8);
+
+    return std::pair<torch::Tensor, torch::Tensor>(quantization_scale.to(torch::kFloat32),
+                                                   tensor_quantized);
+}
+
 template <class Model>
 ModuleHolder<AnyModule> populate_model(Model &&model,
-                                       const std::string &path,
-                                       const torch::TensorOptions &options,
-                                       bool decomposition,
-                                       bool bias) {
-    auto state_dict = load_crf_model_weights(path, decomposition, bias);
+                                       const std::vector<torch::Tensor> &state_dict,
+                                       const torch::TensorOptions &options) {
     model->load_state_dict(state_dict);
     model->to(options.dtype_opt().value().toScalarType());
     model->to(options.device_opt().value());
@@ -133,6 +160,13 @@ struct ConvolutionImpl : Module {
         return activation(conv(x));
     }
 
+    // forward on the CPU with SiLU applied in place on the output of the convolution (no
+    // temporary), used by the optimised graph of CRFModelImpl
+    torch::Tensor forward_fused(torch::Tensor x) {
+        auto y = torch::silu_(conv(x));
+        return to_lstm ? y.transpose(1, 2) : y;
+    }
+
     Conv1d conv{nullptr};
     SiLU activation{nullptr};
     int in_size;
@@ -143,7 +177,7 @@ struct ConvolutionImpl : Module {
 };
 
 struct LinearCRFImpl : Module {
-    LinearCRFImpl(int insize, int outsize) : scale(5), blank_score(2.0), expand_blanks(false) {
+    LinearCRFImpl(int insize, int outsize) : scale(5) {
         linear = register_module("linear", Linear(insize, outsize));
         activation = register_module("activation", Tanh());
     };
@@ -172,13 +206,6 @@ struct LinearCRFImpl : Module {
             scores = activation(linear(x)) * scale;
         }
 
-        if (expand_blanks == true) {
-            scores = scores.contiguous();
-            int C = scores.size(2);
-            scores = F::pad(scores.view({N, T, C / 4, 4}),
-                            F::PadFuncOptions({1, 0, 0, 0, 0, 0, 0, 0}).value(blank_score))
-                             .view({N, T, -1});
-        }
         endTime = realtime();
         time_forward += getTimeDifference();
         forward_l159 += getTimeDifference();
@@ -187,8 +214,6 @@ struct LinearCRFImpl : Module {
     }
 
     int scale;
-    int blank_score;
-    bool expand_blanks;
     Linear linear{nullptr};
     Tanh activation{nullptr};
 };
@@ -221,7 +246,11 @@ struct CudaLSTMImpl : Module {
 TORCH_MODULE(CudaLSTM);
 
 struct CudaLSTMStackImpl : Module {
-    CudaLSTMStackImpl(int layer_size_, int batch_size, int chunk_size) : layer_size(layer_size_) {
+    CudaLSTMStackImpl(int layer_size_,
+                      int batch_size,
+                      int chunk_size,
+                      const CRFModelOptions &model_options)
+            : layer_size(layer_size_) {
         rnn1 = register_module("rnn_1", CudaLSTM(layer_size, true));
         rnn2 = register_module("rnn_2", CudaLSTM(layer_size, false));
         rnn3 = register_module("rnn_3", CudaLSTM(layer_size, true));
@@ -375,36 +404,6 @@ struct CudaLSTMStackImpl : Module {
         _weights_rearranged = true;
     }
 
-    std::pair<torch::Tensor, torch::Tensor> quantize_tensor(torch::Tensor tensor,
-                                                            int levels = 256) {
-                                                                //////////////////////////////
-        //Quantize a tensor to int8, returning per-channel scales and the quantized tensor
-        //if weights have not been quantized we get some scaling
-        tensor = tensor.transpose(0, 1).contiguous();
-        auto fp_max = torch::abs(std::get<0>(torch::max(tensor, 0)));
-        auto fp_min = torch::abs(std::get<0>(torch::min(tensor, 0)));
-
-        auto fp_range =
-                std::get<0>(
-                        torch::cat(
-                                {fp_min.index({torch::indexing::Slice(), torch::indexing::None}),
-                                 fp_max.index({torch::indexing::Slice(), torch::indexing::None})},
-                                1)
-                                .max(1)) *
-                2;
-        auto quantization_scale = levels / fp_range;
-        auto quantization_max = (levels / 2) - 1;
-
-        auto tensor_quantized = (tensor * quantization_scale)
-                                        .round()
-                                        .clip(-quantization_max, quantization_max)
-                                        .to(torch::kI8);
-
-        return std::pair<torch::Tensor, torch::Tensor>(quantization_scale.to(torch::kFloat32),
-                                                       tensor_quantized);
-        
-    }
-
     void quantize_weights() {
         for (auto &rnn : {rnn1, rnn2, rnn3, rnn4, rnn5}) {
             // auto [factors, quantized] = quantize_tensor(rnn->named_parameters()["weight_hh"]);
@@ -503,18 +502,135 @@ TORCH_MODULE(CudaLSTMStack);
 #endif  // if USE_CUDA_LSTM
 
 struct LSTMStackImpl : Module {
-    LSTMStackImpl(int size, int batchsize, int chunksize) {
+    LSTMStackImpl(int size, int batchsize, int chunksize, const CRFModelOptions &model_options)
+            : layer_size(size), lstm_type(model_options.cpu_lstm), check_lstm(model_options.check_cpu_lstm) {
         // torch::nn::LSTM expects/produces [N, T, C] with batch_first == true
         rnn1 = register_module("rnn1", LSTM(LSTMOptions(size, size).batch_first(true)));
         rnn2 = register_module("rnn2", LSTM(LSTMOptions(size, size).batch_first(true)));
         rnn3 = register_module("rnn3", LSTM(LSTMOptions(size, size).batch_first(true)));
         rnn4 = register_module("rnn4", LSTM(LSTMOptions(size, size).batch_first(true)));
         rnn5 = register_module("rnn5", LSTM(LSTMOptions(size, size).batch_first(true)));
+
+        if (lstm_type == CPULSTMType::Int8 && !cpu_lstm_int8_supported(size)) {
+            VERBOSE("no %s int8 kernel for LSTM layer size %d, using fp32", cpu_lstm_int8_isa(),
+                    size);
+            lstm_type = CPULSTMType::SIMD;
+        }
+        if (lstm_type == CPULSTMType::SIMD && !cpu_lstm_supported(size)) {
+            VERBOSE("no %s kernel for LSTM layer size %d, using torch::nn::LSTM", cpu_lstm_isa(),
+                    size);
+            lstm_type = CPULSTMType::Torch;
+        }
     };
 
     torch::Tensor forward(torch::Tensor x) {
         startTime = realtime();
         // Input is [N, T, C], contiguity optional
+        torch::Tensor y;
+        if (lstm_type != CPULSTMType::Torch && x.scalar_type() == torch::kF32 &&
+            x.device().is_cpu()) {
+            y = forward_simd(x);
+            // the module is shared by the runners, only the first batch of any of them is checked
+            if (check_lstm.exchange(false)) {
+                check_against_torch(x, y);
+            }
+        } else {
+            y = forward_torch(x);
+        }
+
+        endTime = realtime();
+        time_forward += getTimeDifference();
+        forward_l536 += getTimeDifference();
+        return y;
+    }
+
+    // The kernel layout of the weights (see CPULSTMWeights) comes from a packed model or is computed
+    // from the torch parameters on the first forward. Only the int8 repacking for the running CPU is
+    // always done here.
+    void prepare_weights() {
+        torch::NoGradGuard no_grad;
+        if (weights.w_ih_t.empty()) {
+            std::vector<torch::Tensor> params;
+            for (auto &rnn : {rnn1, rnn2, rnn3, rnn4, rnn5}) {
+                auto named = rnn->named_parameters();
+                for (auto name : {"weight_ih_l0", "weight_hh_l0", "bias_ih_l0", "bias_hh_l0"}) {
+                    params.push_back(named[name]);
+                }
+            }
+            weights = prepare_cpu_lstm_weights(params, lstm_type == CPULSTMType::Int8);
+        }
+        if (lstm_type == CPULSTMType::Int8) {
+            for (int l = 0; l < 5; ++l) {
+                w_int8.push_back(cpu_lstm_int8_t());
+                cpu_lstm_int8_pack(weights.w_hh_q[l].data_ptr<int8_t>(),
+                                   weights.w_hh_scale[l].data_ptr<float>(), layer_size,
+                                   &w_int8.back());
+            }
+        }
+    }
+
+    torch::Tensor forward_simd(torch::Tensor x) {
+        std::call_once(weights_prepared, [this] { prepare_weights(); });
+
+        const int64_t N = x.size(0);
+        const int64_t T = x.size(1);
+        const int64_t C = layer_size;
+        const int64_t row_blocks = (N + 3) / 4;
+
+        auto gates = torch::empty({N * T, 4 * C}, x.options());
+        torch::Tensor buf[2] = {torch::empty({N, T, C}, x.options()),
+                                torch::empty({N, T, C}, x.options())};
+        double *layer_time[5] = {&rnn1t, &rnn2t, &rnn3t, &rnn4t, &rnn5t};
+
+        x = x.contiguous();
+        for (int l = 0; l < 5; ++l) {
+            subStartTime = realtime();
+            // rnn1, rnn3 and rnn5 run backwards in time, rnn2 and rnn4 forwards
+            const bool reverse = (l % 2) == 0;
+            auto &y = buf[l % 2];
+
+            torch::addmm_out(gates, weights.bias[l], x.view({N * T, C}), weights.w_ih_t[l]);
+
+            const float *gates_ptr = gates.data_ptr<float>();
+            const float *w_ptr = weights.w_hh_t[l].data_ptr<float>();
+            float *y_ptr = y.data_ptr<float>();
+            at::parallel_for(0, row_blocks, 1, [&](int64_t begin, int64_t end) {
+                if (lstm_type == CPULSTMType::Int8) {
+                    cpu_lstm_layer_int8(gates_ptr, &w_int8[l], y_ptr, T, begin * 4,
+                                        std::min(end * 4, N), reverse);
+                } else {
+                    cpu_lstm_layer(gates_ptr, w_ptr, y_ptr, T, C, begin * 4,
+                                   std::min(end * 4, N), reverse);
+                }
+            });
+
+            x = y;
+            subEndTime = realtime();
+            *layer_time[l] += subEndTime - subStartTime;
+        }
+
+        // Output is [N, T, C], contiguous
+        return x;
+    }
+
+    // fp32 has to match torch to rounding. int8 is expected to drift, so only its mean is bounded.
+    void check_against_torch(torch::Tensor x, torch::Tensor y) {
+        auto diff = (forward_torch(x) - y).abs();
+        float max_diff = diff.max().item<float>();
+        float mean_diff = diff.mean().item<float>();
+        const bool int8 = lstm_type == CPULSTMType::Int8;
+        INFO("CPU LSTM check: %s %s kernel abs difference to torch::nn::LSTM max %g mean %g",
+             int8 ? cpu_lstm_int8_isa() : cpu_lstm_isa(), int8 ? "int8" : "fp32", max_diff,
+             mean_diff);
+        const float tolerance = int8 ? 1e-2f : 1e-3f;
+        const float diff_checked = int8 ? mean_diff : max_diff;
+        if (!(diff_checked <= tolerance)) {
+            ERROR("CPU LSTM check failed: difference %g exceeds %g", diff_checked, tolerance);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    torch::Tensor forward_torch(torch::Tensor x) {
 
         // auto [y1, h1] = rnn1(x.flip(1));
         // auto [y2, h2] = rnn2(y1.flip(1));
@@ -592,15 +708,17 @@ struct LSTMStackImpl : Module {
         subEndTime = realtime();
         rnn5t += subEndTime - subStartTime;
 
-        endTime = realtime();
-        time_forward += getTimeDifference();
-        forward_l536 += getTimeDifference();
-
         // Output is [N, T, C], non-contiguous
         return x;
     }
 
     LSTM rnn1{nullptr}, rnn2{nullptr}, rnn3{nullptr}, rnn4{nullptr}, rnn5{nullptr};
+    CPULSTMWeights weights;
+    std::vector<cpu_lstm_int8_t> w_int8;
+    std::once_flag weights_prepared;
+    int layer_size;
+    CPULSTMType lstm_type;
+    std::atomic<bool> check_lstm;
 };
 
 struct ClampImpl : Module {
@@ -629,7 +747,10 @@ TORCH_MODULE(Clamp);
 
 template <class LSTMStackType>
 struct CRFModelImpl : Module {
-    CRFModelImpl(const CRFModelConfig &config, bool expand_blanks, int batch_size, int chunk_size) {
+    CRFModelImpl(const CRFModelConfig &config,
+                 int batch_size,
+                 int chunk_size,
+                 const CRFModelOptions &model_options) {
         conv1 = register_module("conv1", Convolution(config.num_features, config.conv, 5, 1));
         clamp1 = Clamp(-0.5, 3.5, config.clamp);
         conv2 = register_module("conv2", Convolution(config.conv, 16, 5, 1));
@@ -638,7 +759,8 @@ struct CRFModelImpl : Module {
         clamp3 = Clamp(-0.5, 3.5, config.clamp);
 
         rnns = register_module(
-                "rnns", LSTMStackType(config.insize, batch_size, chunk_size / config.stride));
+                "rnns", LSTMStackType(config.insize, batch_size, chunk_size / config.stride,
+                                       model_options));
 
         if (config.decomposition) {
             // The linear layer is decomposed into 2 matmuls.
@@ -671,9 +793,120 @@ struct CRFModelImpl : Module {
         time_forward += getTimeDifference();
         forward_l642 += getTimeDifference();
         // Output is [N, T, C]
+        if (graph.active) {
+            return forward_optimised(x);
+        }
         return encoder->forward(x);
     }
 
+    // Load time rewrite of the encoder for the CPU, called once the weights are loaded:
+    //  - linear1 and linear2 of a decomposed head are folded into one matrix (W2 W1, bias W2 b1) when
+    //    that takes fewer multiply-adds per timestep than the two matmuls
+    //  - inactive clamps are dropped
+    //  - the bias goes into the GEMM (addmm) and SiLU, clamp, tanh and the scale are applied in place
+    // The result runs in forward_optimised() with direct calls instead of the Sequential.
+    void optimise() {
+        torch::NoGradGuard no_grad;
+        std::string report;
+        // the LinearCRF encoder has no clamps, in the others all four share config.clamp
+        const bool has_clamps = !linear;
+        const bool conv_clamps = has_clamps && clamp1->active;
+        const int32_t dropped = has_clamps && !clamp1->active ? 4 : 0;
+        graph.clamp_conv = conv_clamps;
+
+        if (linear) {
+            graph.w_t = linear->linear->weight.t().contiguous();
+            graph.bias = linear->linear->bias;
+            graph.head = OptimisedGraph::TANH_SCALE;
+            report = "bias+tanh+scale fused into the head";
+        } else {
+            graph.head = clamp4->active ? OptimisedGraph::CLAMP : OptimisedGraph::NONE;
+            auto w1 = linear1->weight;
+            graph.bias = linear1->options.bias() ? linear1->bias : torch::Tensor();
+            if (linear2) {
+                auto w2 = linear2->weight;
+                const int64_t in = w1.size(1), dec = w1.size(0), out = w2.size(0);
+                const int64_t split_macs = in * dec + dec * out;
+                const int64_t folded_macs = in * out;
+                if (folded_macs < split_macs) {
+                    graph.w_t = torch::mm(w2.to(torch::kF32), w1.to(torch::kF32)).t().contiguous().to(w1.dtype());
+                    if (graph.bias.defined()) {
+                        graph.bias = torch::mv(w2.to(torch::kF32), graph.bias.to(torch::kF32)).to(w1.dtype());
+                    }
+                    report = "linear1·linear2 folded (" + std::to_string(split_macs) + " -> " +
+                             std::to_string(folded_macs) + " MACs per step)";
+                } else {
+                    graph.w_t = w1.t().contiguous();
+                    graph.w2_t = w2.t().contiguous();
+                    report = "linear1·linear2 kept (folding would take " + std::to_string(folded_macs) +
+                             " instead of " + std::to_string(split_macs) + " MACs per step)";
+                }
+            } else {
+                graph.w_t = w1.t().contiguous();
+            }
+            report += graph.bias.defined() ? ", bias fused into the GEMM" : "";
+            report += graph.head == OptimisedGraph::CLAMP ? ", clamp in place" : "";
+        }
+        report += ", SiLU in place in 3 convolutions";
+        if (conv_clamps) {
+            report += " with their clamps";
+        }
+        if (dropped > 0) {
+            report += ", " + std::to_string(dropped) + " inactive clamps dropped";
+        }
+        graph.active = true;
+        VERBOSE("model graph: %s", report.c_str());
+    }
+
+    // Input is [N, C, T], output is [N, T, C] as from the encoder
+    torch::Tensor forward_optimised(torch::Tensor x) {
+        x = conv1->forward_fused(x);
+        if (graph.clamp_conv) {
+            x.clamp_(clamp1->min, clamp1->max);
+        }
+        x = conv2->forward_fused(x);
+        if (graph.clamp_conv) {
+            x.clamp_(clamp1->min, clamp1->max);
+        }
+        x = conv3->forward_fused(x);
+        if (graph.clamp_conv) {
+            x.clamp_(clamp1->min, clamp1->max);
+        }
+        x = rnns->forward(x);
+
+        auto N = x.size(0);
+        auto T = x.size(1);
+        auto x2d = x.reshape({N * T, -1});
+        auto scores = graph.bias.defined() ? torch::addmm(graph.bias, x2d, graph.w_t)
+                                           : torch::mm(x2d, graph.w_t);
+        if (graph.w2_t.defined()) {
+            scores = torch::mm(scores, graph.w2_t);
+        }
+        scores = scores.view({N, T, -1});
+
+        switch (graph.head) {
+        case OptimisedGraph::CLAMP:
+            scores.clamp_(clamp4->min, clamp4->max);
+            break;
+        case OptimisedGraph::TANH_SCALE:
+            scores.tanh_().mul_(linear->scale);
+            break;
+        case OptimisedGraph::NONE:
+            break;
+        }
+        return scores;
+    }
+
+    struct OptimisedGraph {
+        enum Head { NONE, CLAMP, TANH_SCALE };
+        bool active = false;
+        bool clamp_conv = false;
+        torch::Tensor w_t;   // [C_in, C_out], linear1 or the folded linear1·linear2
+        torch::Tensor w2_t;  // linear2 when it is not folded
+        torch::Tensor bias;  // undefined if the head has none
+        Head head = NONE;
+    } graph;
+
     LSTMStackType rnns{nullptr};
     LinearCRF linear{nullptr};
     Linear linear1{nullptr}, linear2{nullptr};
@@ -725,6 +958,7 @@ CRFModelConfig load_crf_model_config(const std::string &path) {
     config.bias = true;
     config.clamp = false;
     config.decomposition = false;
+    config.blank_score = 2.0f;
 
     // The encoder scale only appears in pre-v4 models.  In v4 models
     // the value of 1 is used.
@@ -759,7 +993,11 @@ CRFModelConfig load_crf_model_config(const std::string &path) {
             } else if (strcmp(type, "clamp") == 0) {
                 config.clamp = true;
             } else if (strcmp(type, "linearcrfencoder") == 0) {
-                config.blank_score = (float)toml_double_in(segment, "blank_score").u.d;
+                // blank_score is optional, the default above holds when it is missing
+                toml_datum_t blank_score = toml_double_in(segment, "blank_score");
+                if (blank_score.ok) {
+                    config.blank_score = (float)blank_score.u.d;
+                }
             }
 
             free(type);
@@ -774,7 +1012,10 @@ CRFModelConfig load_crf_model_config(const std::string &path) {
         // pre-v4 model
         config.stride = toml_int_in(encoder, "stride").u.i;
         config.insize = toml_int_in(encoder, "features").u.i;
-        config.blank_score = (float)toml_double_in(encoder, "blank_score").u.d;
+        toml_datum_t blank_score = toml_double_in(encoder, "blank_score");
+        if (blank_score.ok) {
+            config.blank_score = (float)blank_score.u.d;
+        }
         config.scale = (float)toml_double_in(encoder, "scale").u.d;
 
         if (toml_key_exists(encoder, "first_conv_size")) {
@@ -798,9 +1039,7 @@ CRFModelConfig load_crf_model_config(const std::string &path) {
     return config;
 }
 
-std::vector<torch::Tensor> load_crf_model_weights(const std::string &dir,
-                                                  bool decomposition,
-                                                  bool bias) {
+std::vector<std::string> crf_model_weight_names(bool decomposition, bool bias) {
     auto tensors = std::vector<std::string>{
             "0.conv.weight.tensor",      "0.conv.bias.tensor",
 
@@ -833,26 +1072,70 @@ std::vector<torch::Tensor> load_crf_model_weights(const std::string &dir,
         tensors.push_back("10.linear.weight.tensor");
     }
 
-    return load_tensors(dir, tensors);
+    return tensors;
+}
+
+std::vector<torch::Tensor> load_crf_model_weights(const std::string &dir,
+                                                  bool decomposition,
+                                                  bool bias) {
+    return load_tensors(dir, crf_model_weight_names(decomposition, bias));
+}
+
+CPULSTMWeights prepare_cpu_lstm_weights(const std::vector<torch::Tensor> &params, bool quantise) {
+    torch::NoGradGuard no_grad;
+    CPULSTMWeights weights;
+    for (size_t l = 0; l + 4 <= params.size(); l += 4) {
+        weights.w_ih_t.push_back(params[l].t().contiguous());
+        weights.w_hh_t.push_back(params[l + 1].t().contiguous());
+        weights.bias.push_back((params[l + 2] + params[l + 3]).contiguous());
+        if (quantise) {
+            auto t0 = quantize_tensor(params[l + 1]);
+            weights.w_hh_scale.push_back(std::get<0>(t0).contiguous());
+            weights.w_hh_q.push_back(std::get<1>(t0).contiguous());
+        }
+    }
+    return weights;
 }
 
 ModuleHolder<AnyModule> load_crf_model(const std::string &path,
                                        const CRFModelConfig &model_config,
                                        const int batch_size,
                                        const int chunk_size,
-                                       const torch::TensorOptions &options) {
+                                       const torch::TensorOptions &options,
+                                       const CRFModelOptions &model_options) {
+    auto state_dict = load_crf_model_weights(path, model_config.decomposition, model_config.bias);
+    return load_crf_model(model_config, state_dict, CPULSTMWeights(), batch_size, chunk_size, options,
+                          model_options);
+}
+
+ModuleHolder<AnyModule> load_crf_model(const CRFModelConfig &model_config,
+                                       const std::vector<torch::Tensor> &state_dict,
+                                       const CPULSTMWeights &lstm_weights,
+                                       const int batch_size,
+                                       const int chunk_size,
+                                       const torch::TensorOptions &options,
+                                       const CRFModelOptions &model_options) {
 #if USE_CUDA_LSTM
     if (options.device() != torch::kCPU) {
-        const bool expand_blanks = false;
-        auto model = CudaCRFModel(model_config, expand_blanks, batch_size, chunk_size);
-        return populate_model(model, path, options, model_config.decomposition,
-                              model_config.bias);
+        auto model = CudaCRFModel(model_config, batch_size, chunk_size,
+                                  model_options);
+        return populate_model(model, state_dict, options);
     } else
 #endif
     {
-        const bool expand_blanks = true;
-        auto model = CpuCRFModel(model_config, expand_blanks, batch_size, chunk_size);
-        return populate_model(model, path, options, model_config.decomposition,
-                              model_config.bias);
+        // the scores stay in the compact [N, T, 4^(state_len + 1)] layout, the decoder adds the
+        // fixed blank (stay) score itself
+        CRFModelOptions cpu_model_options = model_options;
+        if (options.device() != torch::kCPU) {
+            // a GPU build without koi: the SIMD LSTM kernels only read host memory
+            cpu_model_options.cpu_lstm = CPULSTMType::Torch;
+            cpu_model_options.check_cpu_lstm = false;
+        }
+        auto model = CpuCRFModel(model_config, batch_size, chunk_size,
+                                 cpu_model_options);
+        model->rnns->weights = lstm_weights;
+        auto holder = populate_model(model, state_dict, options);
+        model->optimise();
+        return holder;
     }
 }
@@ -2,6 +2,7 @@
 
 #include <torch/torch.h>
 
+#include <string>
 #include <vector>
 
 // Values extracted from config.toml used in construction of the model module.
@@ -25,8 +26,36 @@ struct CRFModelConfig {
     int num_features;
 };
 
+// Implementation of the LSTM layers when running on the CPU.
+enum class CPULSTMType {
+    Torch,  // torch::nn::LSTM
+    SIMD,   // hand written fp32 kernels in cpu_lstm.cpp, falls back to Torch where unsupported
+    Int8,   // as SIMD with int8 recurrent weights (AVX2 / AVX-512 VNNI), falls back to SIMD
+};
+
+// Runtime choices that do not come from config.toml.
+struct CRFModelOptions {
+    CPULSTMType cpu_lstm = CPULSTMType::SIMD;
+    // Run the first batch through torch::nn::LSTM as well and fail if the outputs differ.
+    bool check_cpu_lstm = false;
+    // Copy the weights of a packed model out of the mapping, so they are allocated on the NUMA node
+    // of the loading thread instead of shared page cache pages.
+    bool copy_packed_weights = false;
+};
+
+// Weights of the CPU LSTM layers in the layout of the SIMD kernels, one entry per layer:
+// W_ih^T, W_hh^T and b_ih + b_hh, and for the int8 kernels W_hh^T quantised per gate column
+// (w_hh_q ~= W_hh^T * w_hh_scale). Empty vectors if they are to be computed from the parameters.
+struct CPULSTMWeights {
+    std::vector<torch::Tensor> w_ih_t, w_hh_t, bias;
+    std::vector<torch::Tensor> w_hh_q, w_hh_scale;
+};
+
 CRFModelConfig load_crf_model_config(const std::string& path);
 
+// File names of the weights in a model directory, in the order of the module parameters.
+std::vector<std::string> crf_model_weight_names(bool decomposition, bool bias);
+
 std::vector<torch::Tensor> load_crf_model_weights(const std::string& dir,
                                                   bool decomposition,
                                                   bool bias);
@@ -35,4 +64,18 @@ torch::nn::ModuleHolder<torch::nn::AnyModule> load_crf_model(const std::string&
                                                              const CRFModelConfig& model_config,
                                                              int batch_size,
                                                              int chunk_size,
-                                                             const torch::TensorOptions& options);
+                                                             const torch::TensorOptions& options,
+                                                             const CRFModelOptions& model_options = CRFModelOptions());
+
+// As above with the config and weights already loaded (e.g. mapped from a packed model).
+torch::nn::ModuleHolder<torch::nn::AnyModule> load_crf_model(const CRFModelConfig& model_config,
+                                                             const std::vector<torch::Tensor>& state_dict,
+                                                             const CPULSTMWeights& lstm_weights,
+                                                             int batch_size,
+                                                             int chunk_size,
+                                                             const torch::TensorOptions& options,
+                                                             const CRFModelOptions& model_options = CRFModelOptions());
+
+// params: weight_ih, weight_hh, bias_ih and bias_hh of each LSTM layer in turn.
+// With quantise the int8 W_hh^T and its scales are filled in as well.
+CPULSTMWeights prepare_cpu_lstm_weights(const std::vector<torch::Tensor>& params, bool quantise);
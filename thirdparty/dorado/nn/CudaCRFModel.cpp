@@ -1,6 +1,7 @@
 #include "CudaCRFModel.h"
 
 #include "dorado/decode/GPUDecoder.h"
+#include "packed_model.h"
 #include "error.h"
 
 #include "../../../src/globals.h"
@@ -26,7 +27,12 @@ public:
         isCUDA = true;
         startTime = realtime();
         //fprintf("\n[%s]", __func__);
-        const auto model_config = load_crf_model_config(model_path);
+        const bool packed = is_packed_model(model_path);
+        PackedModel packed_model;
+        if (packed) {
+            packed_model = map_packed_model(model_path);
+        }
+        const auto model_config = packed ? packed_model.config : load_crf_model_config(model_path);
         
         m_model_stride = static_cast<size_t>(model_config.stride);
 
@@ -37,7 +43,12 @@ public:
         m_num_input_features = model_config.num_features;
 
         m_options = torch::TensorOptions().dtype(GPUDecoder::dtype).device(device);
-        m_module = load_crf_model(model_path, model_config, batch_size, chunk_size, m_options);
+        if (packed) {
+            m_module = load_crf_model(model_config, packed_model.state_dict, CPULSTMWeights(),
+                                      batch_size, chunk_size, m_options);
+        } else {
+            m_module = load_crf_model(model_path, model_config, batch_size, chunk_size, m_options);
+        }
 
         m_cuda_thread.reset(new std::thread(&CudaCaller::cuda_thread_fn, this));
         endTime = realtime();
@@ -170,15 +181,36 @@ CudaModelRunner::CudaModelRunner(std::shared_ptr<CudaCaller> caller, int chunk_s
             {3, batch_size, block_size},
             torch::TensorOptions().dtype(torch::kInt8).device(torch::kCPU).pinned_memory(true));
     // warm up
-    call_chunks(batch_size);
+    submit_chunks(batch_size);
+    collect_chunks();
+}
+
+void CudaModelRunner::accept_chunk(int chunk_idx, const read_signal_t &signal, size_t offset) {
+    const size_t chunk_size = m_input.size(2);
+    if (m_input.scalar_type() == torch::kFloat16) {
+        copy_chunk(signal, offset, chunk_size, m_input.data_ptr<c10::Half>() + chunk_idx * chunk_size);
+    } else {
+        copy_chunk(signal, offset, chunk_size, m_input.data_ptr<float>() + chunk_idx * chunk_size);
+    }
+}
+
+// the koi kernels are planned for one input shape
+void CudaModelRunner::set_batch_chunk_size(size_t chunk_size) {
+    if (chunk_size != this->chunk_size()) {
+        throw std::runtime_error("chunk length buckets are not supported with the koi LSTM");
+    }
 }
 
-void CudaModelRunner::accept_chunk(int chunk_idx, at::Tensor slice) {
-    m_input.index_put_({chunk_idx, torch::indexing::Ellipsis}, slice);
+// The caller thread already overlaps the GPU forward of one runner with the CPU decode of the
+// others, so a batch is complete by the time submit returns.
+void CudaModelRunner::submit_chunks(int num_chunks) {
+    m_decoded.push_back(m_caller->call_chunks(m_input, m_output, num_chunks, m_stream));
 }
 
-std::vector<DecodedChunk> CudaModelRunner::call_chunks(int num_chunks) {
-    return m_caller->call_chunks(m_input, m_output, num_chunks, m_stream);
+std::vector<DecodedChunk> CudaModelRunner::collect_chunks() {
+    auto decoded = std::move(m_decoded.front());
+    m_decoded.pop_front();
+    return decoded;
 }
 
 size_t CudaModelRunner::model_stride() const { return m_caller->m_model_stride; }
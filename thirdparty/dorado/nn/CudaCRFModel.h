@@ -5,6 +5,7 @@
 #include <c10/cuda/CUDAStream.h>
 #include <torch/torch.h>
 
+#include <deque>
 #include <memory>
 #include <vector>
 
@@ -18,8 +19,10 @@ std::shared_ptr<CudaCaller> create_cuda_caller(const std::string& model_path,
 class CudaModelRunner : public ModelRunnerBase {
 public:
     CudaModelRunner(std::shared_ptr<CudaCaller> caller, int chunk_size, int batch_size);
-    void accept_chunk(int chunk_idx, at::Tensor slice) final;
-    std::vector<DecodedChunk> call_chunks(int num_chunks) final;
+    void accept_chunk(int chunk_idx, const read_signal_t &signal, size_t offset) final;
+    void set_batch_chunk_size(size_t chunk_size) final;
+    void submit_chunks(int num_chunks) final;
+    std::vector<DecodedChunk> collect_chunks() final;
     size_t model_stride() const final;
     size_t chunk_size() const final;
 
@@ -28,4 +31,5 @@ private:
     c10::cuda::CUDAStream m_stream;
     torch::Tensor m_input;
     torch::Tensor m_output;
+    std::deque<std::vector<DecodedChunk>> m_decoded;
 };
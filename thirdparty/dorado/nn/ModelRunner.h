@@ -1,94 +1,225 @@
 #pragma once
 
 #include "../decode/Decoder.h"
+#include "../signal_prep.h"
 #include "CRFModel.h"
+#include "packed_model.h"
 #include "../decode/CPUDecoder.h"
 
 #include "toml.h"
 #include "error.h"
 #include <torch/torch.h>
 
+#include <algorithm>
+#include <deque>
+#include <future>
+#include <stdexcept>
 #include <string>
 
+class ThreadPool;
+
 class ModelRunnerBase {
 public:
-    virtual void accept_chunk(int chunk_idx, at::Tensor slice) = 0;
-    virtual std::vector<DecodedChunk> call_chunks(int num_chunks) = 0;
+    // Normalises the chunk of signal starting at offset straight into slot chunk_idx of the batch.
+    virtual void accept_chunk(int chunk_idx, const read_signal_t &signal, size_t offset) = 0;
+    // Chunk length of the batch about to be filled, a stride multiple up to chunk_size().
+    // Runners with a fixed input shape only take chunk_size().
+    virtual void set_batch_chunk_size(size_t chunk_size) = 0;
+    // Runs the accepted batch and returns as soon as the input buffer may be refilled. The batch
+    // can still be decoding in the background; collect_chunks() returns the batches in submission
+    // order and blocks until the oldest one is done.
+    virtual void submit_chunks(int num_chunks) = 0;
+    virtual std::vector<DecodedChunk> collect_chunks() = 0;
     virtual size_t model_stride() const = 0;
     virtual size_t chunk_size() const = 0;
 };
 
 using Runner = std::shared_ptr<ModelRunnerBase>;
 
+// A model loaded for one device. The weights are read-only after loading, so any number of runners can
+// share it; each runner keeps its own input buffer, decoder and activations.
+struct LoadedModel {
+    CRFModelConfig config;
+    torch::TensorOptions options; // dtype and device of the weights, also the dtype of the runner input
+    torch::nn::ModuleHolder<torch::nn::AnyModule> module{nullptr};
+};
+using SharedModel = std::shared_ptr<const LoadedModel>;
+
 template <typename T>
 class ModelRunner : public ModelRunnerBase { //ModelRunner is a derived class from ModelRunnerBase
 public:
     ModelRunner(const std::string &model_path,
                 const std::string &device,
                 int chunk_size,
-                int batch_size);
-    void accept_chunk(int chunk_idx, at::Tensor slice) final;
-    std::vector<DecodedChunk> call_chunks(int num_chunks) final;
+                int batch_size,
+                const CRFModelOptions &model_options = CRFModelOptions(),
+                ThreadPool *decode_pool = nullptr);
+    // a runner on a model already loaded for its device
+    // decoder_options: the model independent decoder settings, e.g. int8_scores and qstring
+    ModelRunner(const SharedModel &model,
+                const std::string &device,
+                int chunk_size,
+                int batch_size,
+                ThreadPool *decode_pool = nullptr,
+                const DecoderOptions &decoder_options = DecoderOptions());
+    static SharedModel load_model(const std::string &model_path,
+                                  const std::string &device,
+                                  int chunk_size,
+                                  int batch_size,
+                                  const CRFModelOptions &model_options = CRFModelOptions());
+    void accept_chunk(int chunk_idx, const read_signal_t &signal, size_t offset) final;
+    void set_batch_chunk_size(size_t chunk_size) final;
+    void submit_chunks(int num_chunks) final;
+    std::vector<DecodedChunk> collect_chunks() final;
     size_t model_stride() const final { return m_model_stride; }
     size_t chunk_size() const final { return m_input.size(2); }
 
 private:
+    // number of batch rows to run the forward pass on for num_chunks filled ones
+    int64_t forward_rows(int num_chunks) const;
+
     std::string m_device;
     torch::Tensor m_input;
+    torch::Tensor m_batch_input; // the front of m_input viewed at the chunk length of the current batch
     torch::TensorOptions m_options;
     std::unique_ptr<T> m_decoder;
     DecoderOptions m_decoder_options;
     torch::nn::ModuleHolder<torch::nn::AnyModule> m_module{nullptr};
     size_t m_model_stride;
-
+    ThreadPool *m_decode_pool;
+    std::deque<std::future<std::vector<DecodedChunk>>> m_pending; // submitted batches, oldest first
 };
 
+template <typename T>
+SharedModel ModelRunner<T>::load_model(const std::string &model_path,
+                                       const std::string &device,
+                                       int chunk_size,
+                                       int batch_size,
+                                       const CRFModelOptions &model_options) {
+    auto model = std::make_shared<LoadedModel>();
+#if defined(USE_GPU) && defined(USE_CUDA_LSTM)
+    model->options = torch::TensorOptions().dtype(T::dtype).device(device); //todo
+#else
+    model->options = torch::TensorOptions().dtype(CPUDecoder::dtype).device(device); //todo
+#endif
+    if (is_packed_model(model_path)) {
+        // on the CPU the weights are used in place from the mapping, unless they have to be node local
+        PackedModel packed = map_packed_model(model_path);
+        if (model_options.copy_packed_weights) {
+            copy_packed_model(packed);
+        }
+        model->config = packed.config;
+        model->module = load_crf_model(packed.config, packed.state_dict, packed.lstm_weights, batch_size, chunk_size, model->options, model_options);
+    } else {
+        model->config = load_crf_model_config(model_path);
+        model->module = load_crf_model(model_path, model->config, batch_size, chunk_size, model->options, model_options);
+    }
+    return model;
+}
+
 template <typename T>
 ModelRunner<T>::ModelRunner(const std::string &model_path,
                             const std::string &device,
                             int chunk_size,
-                            int batch_size) {
-    const auto model_config = load_crf_model_config(model_path);
-    m_model_stride = static_cast<size_t>(model_config.stride);
+                            int batch_size,
+                            const CRFModelOptions &model_options,
+                            ThreadPool *decode_pool)
+        : ModelRunner(load_model(model_path, device, chunk_size, batch_size, model_options),
+                      device, chunk_size, batch_size, decode_pool) {}
 
-    m_decoder_options = DecoderOptions();
-    m_decoder_options.q_shift = model_config.qbias;
-    m_decoder_options.q_scale = model_config.qscale;
+template <typename T>
+ModelRunner<T>::ModelRunner(const SharedModel &model,
+                            const std::string &device,
+                            int chunk_size,
+                            int batch_size,
+                            ThreadPool *decode_pool,
+                            const DecoderOptions &decoder_options)
+        : m_decode_pool(decode_pool) {
+    m_model_stride = static_cast<size_t>(model->config.stride);
+
+    m_decoder_options = decoder_options;
+    m_decoder_options.q_shift = model->config.qbias;
+    m_decoder_options.q_scale = model->config.qscale;
+    m_decoder_options.blank_score = model->config.blank_score;
     m_decoder = std::make_unique<T>();
     m_device = device;
 
     LOG_DEBUG("initialized model runner for device %s", device.c_str());
 
-#ifdef USE_GPU
-    #ifdef USE_CUDA_LSTM
-        m_options = torch::TensorOptions().dtype(T::dtype).device(device); //todo
-        m_module = load_crf_model(model_path, model_config, batch_size, chunk_size, m_options);
-        chunk_size -= chunk_size % m_model_stride;
-        m_input = torch::zeros({batch_size, 1, chunk_size}, torch::TensorOptions().dtype(T::dtype).device(torch::kCPU)); //todo
-    #else
-        m_options = torch::TensorOptions().dtype(CPUDecoder::dtype).device(device); //todo
-        m_module = load_crf_model(model_path, model_config, batch_size, chunk_size, m_options);
-        chunk_size -= chunk_size % m_model_stride;
-        m_input = torch::zeros({batch_size, 1, chunk_size}, torch::TensorOptions().dtype(CPUDecoder::dtype).device(torch::kCPU)); //todo
-    #endif
-#else
-    m_options = torch::TensorOptions().dtype(CPUDecoder::dtype).device(device); //todo
-    m_module = load_crf_model(model_path, model_config, batch_size, chunk_size, m_options);
+    m_options = model->options;
+    m_module = model->module;
     chunk_size -= chunk_size % m_model_stride;
-    m_input = torch::zeros({batch_size, 1, chunk_size}, torch::TensorOptions().dtype(CPUDecoder::dtype).device(torch::kCPU)); //todo
-#endif
+    m_input = torch::zeros({batch_size, 1, chunk_size}, torch::TensorOptions().dtype(m_options.dtype()).device(torch::kCPU));
+    m_batch_input = m_input;
 }
 
-template<typename T> std::vector<DecodedChunk> ModelRunner<T>::call_chunks(int num_chunks) {
+template<typename T> void ModelRunner<T>::set_batch_chunk_size(size_t chunk_size) {
+    if (chunk_size == (size_t)m_batch_input.size(2)) {
+        return;
+    }
+    if (chunk_size > (size_t)m_input.size(2) || chunk_size % m_model_stride != 0) {
+        throw std::runtime_error("invalid batch chunk size " + std::to_string(chunk_size));
+    }
+    const int64_t batch_size = m_input.size(0);
+    m_batch_input = m_input.view(-1).narrow(0, 0, batch_size * chunk_size).view({batch_size, 1, (int64_t)chunk_size});
+}
+
+template<typename T> int64_t ModelRunner<T>::forward_rows(int num_chunks) const {
+    const int64_t batch_size = m_input.size(0);
+    if (m_options.device().is_cpu()) {
+        return std::max(num_chunks, 1);
+    }
+    // On the GPU round up to a multiple of an eighth of the batch, so the libraries only ever
+    // plan kernels for a handful of shapes.
+    const int64_t step = std::max<int64_t>(batch_size / 8, 1);
+    return std::min(batch_size, std::max<int64_t>((num_chunks + step - 1) / step * step, step));
+}
+
+template<typename T> void ModelRunner<T>::submit_chunks(int num_chunks) {
     torch::InferenceMode guard;
-    auto scores = m_module->forward(m_input.to(m_options.device_opt().value())); 
+    // rows past num_chunks hold stale chunks of an earlier batch, so they are left out
+    auto input = m_batch_input.narrow(0, 0, forward_rows(num_chunks));
+    auto scores = m_module->forward(input.to(m_options.device_opt().value()));
 #ifdef USE_KOI
-    return m_decoder->beam_search(scores, num_chunks, m_decoder_options, m_device);
+    std::promise<std::vector<DecodedChunk>> decoded;
+    decoded.set_value(m_decoder->beam_search(scores, num_chunks, m_decoder_options, m_device));
+    m_pending.push_back(decoded.get_future());
 #else
-    return beam_search_cpu(scores, num_chunks, m_decoder_options, m_device);
+    // The scores own their storage, so the beam search can run on the decode pool while the
+    // caller accepts and forwards the next batch into m_input.
+    float score_scale = 1.0f;
+    if (m_decoder_options.int8_scores) {
+        // only the int8 copy is kept while the batch waits for and goes through the decoder
+        scores = quantise_scores(scores, &score_scale);
+    }
+    auto decode = std::make_shared<std::packaged_task<std::vector<DecodedChunk>()>>(
+            [this, scores, num_chunks, score_scale] {
+                torch::InferenceMode decode_guard;
+                return beam_search_cpu(scores, num_chunks, m_decoder_options, m_device, m_decode_pool, score_scale);
+            });
+    m_pending.push_back(decode->get_future());
+    if (m_decode_pool) {
+        m_decode_pool->submit([decode] { (*decode)(); });
+    } else {
+        (*decode)();
+    }
 #endif
 }
 
-template<typename T> void ModelRunner<T>::accept_chunk(int num_chunks, at::Tensor slice) {
-    m_input.index_put_({num_chunks, 0}, slice);
+template<typename T> std::vector<DecodedChunk> ModelRunner<T>::collect_chunks() {
+    if (m_pending.empty()) {
+        throw std::runtime_error("collect_chunks() called with no batch submitted");
+    }
+    auto decoded = m_pending.front().get();
+    m_pending.pop_front();
+    return decoded;
+}
+
+template<typename T> void ModelRunner<T>::accept_chunk(int chunk_idx, const read_signal_t &signal, size_t offset) {
+    const size_t chunk_size = m_batch_input.size(2);
+    if (m_batch_input.scalar_type() == torch::kFloat16) {
+        copy_chunk(signal, offset, chunk_size, m_batch_input.data_ptr<c10::Half>() + chunk_idx * chunk_size);
+    } else {
+        copy_chunk(signal, offset, chunk_size, m_batch_input.data_ptr<float>() + chunk_idx * chunk_size);
+    }
 }
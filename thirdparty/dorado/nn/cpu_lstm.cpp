@@ -0,0 +1,479 @@
+#include "cpu_lstm.h"
+
+#include "../utils/simd.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+// Rows of the batch stepped together, so that each recurrent weight load feeds several FMAs.
+static const int ROW_BLOCK = 4;
+
+// Fixed quantization scale of the hidden state in the int8 kernels.
+static const float H_SCALE = 127.0f;
+
+static inline float sigmoidf(float x) { return 1.0f / (1.0f + expf(-x)); }
+
+/******************************** LSTM cell *********************************/
+
+// c = f * c + i * g, h = o * tanh(c) from the pre-activations a = [i, f, g, o] of one row.
+// h is written to both the recurrent state and the output.
+
+static void lstm_cell_scalar(const float *a, float *c, float *h, float *o, int H) {
+    for (int j = 0; j < H; ++j) {
+        float cj = sigmoidf(a[H + j]) * c[j] + sigmoidf(a[j]) * tanhf(a[2 * H + j]);
+        c[j] = cj;
+        h[j] = sigmoidf(a[3 * H + j]) * tanhf(cj);
+        o[j] = h[j];
+    }
+}
+
+SIMD_AVX2 static void lstm_cell_avx2(const float *a, float *c, float *h, float *o, int H) {
+    for (int j = 0; j < H; j += 8) {
+        __m256 gi = sigmoid256_ps(_mm256_loadu_ps(a + j));
+        __m256 gf = sigmoid256_ps(_mm256_loadu_ps(a + H + j));
+        __m256 gg = tanh256_ps(_mm256_loadu_ps(a + 2 * H + j));
+        __m256 go = sigmoid256_ps(_mm256_loadu_ps(a + 3 * H + j));
+        __m256 cj = _mm256_fmadd_ps(gf, _mm256_loadu_ps(c + j), _mm256_mul_ps(gi, gg));
+        __m256 hj = _mm256_mul_ps(go, tanh256_ps(cj));
+        _mm256_storeu_ps(c + j, cj);
+        _mm256_storeu_ps(h + j, hj);
+        _mm256_storeu_ps(o + j, hj);
+    }
+}
+
+// GCC 12 flags the _mm512_undefined_ps() passthrough inside the AVX-512 intrinsics when they are
+// inlined into target attributed functions, so the warning is off for the AVX-512 kernels only.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+SIMD_AVX512 static void lstm_cell_avx512(const float *a, float *c, float *h, float *o, int H) {
+    for (int j = 0; j < H; j += 16) {
+        __m512 gi = sigmoid512_ps(_mm512_loadu_ps(a + j));
+        __m512 gf = sigmoid512_ps(_mm512_loadu_ps(a + H + j));
+        __m512 gg = tanh512_ps(_mm512_loadu_ps(a + 2 * H + j));
+        __m512 go = sigmoid512_ps(_mm512_loadu_ps(a + 3 * H + j));
+        __m512 cj = _mm512_fmadd_ps(gf, _mm512_loadu_ps(c + j), _mm512_mul_ps(gi, gg));
+        __m512 hj = _mm512_mul_ps(go, tanh512_ps(cj));
+        _mm512_storeu_ps(c + j, cj);
+        _mm512_storeu_ps(h + j, hj);
+        _mm512_storeu_ps(o + j, hj);
+    }
+}
+#pragma GCC diagnostic pop
+
+/********************************** scalar **********************************/
+
+template <int R>
+static void lstm_rows_scalar(const float *gates,
+                             const float *w,
+                             float *out,
+                             int T,
+                             int H,
+                             bool reverse,
+                             float *acc,
+                             float *h,
+                             float *c) {
+    const int G = 4 * H;
+    for (int step = 0; step < T; ++step) {
+        int t = reverse ? T - 1 - step : step;
+        for (int r = 0; r < R; ++r) {
+            memcpy(acc + r * G, gates + ((size_t)r * T + t) * G, G * sizeof(float));
+        }
+        for (int k = 0; k < H; ++k) {
+            const float *wk = w + (size_t)k * G;
+            for (int r = 0; r < R; ++r) {
+                float hk = h[r * H + k];
+                float *a = acc + r * G;
+                for (int j = 0; j < G; ++j) {
+                    a[j] += hk * wk[j];
+                }
+            }
+        }
+        for (int r = 0; r < R; ++r) {
+            lstm_cell_scalar(acc + r * G, c + r * H, h + r * H, out + ((size_t)r * T + t) * H, H);
+        }
+    }
+}
+
+/*********************************** AVX2 ***********************************/
+
+template <int R>
+SIMD_AVX2 static void lstm_rows_avx2(const float *gates,
+                                     const float *w,
+                                     float *out,
+                                     int T,
+                                     int H,
+                                     bool reverse,
+                                     float *acc,
+                                     float *h,
+                                     float *c) {
+    const int G = 4 * H;
+    for (int step = 0; step < T; ++step) {
+        int t = reverse ? T - 1 - step : step;
+
+        // gates(t) + h(t-1)·W_hh^T, in register tiles of R rows x 16 gate columns
+        for (int j = 0; j < G; j += 16) {
+            __m256 a[R][2];
+            for (int r = 0; r < R; ++r) {
+                const float *g = gates + ((size_t)r * T + t) * G + j;
+                a[r][0] = _mm256_loadu_ps(g);
+                a[r][1] = _mm256_loadu_ps(g + 8);
+            }
+            for (int k = 0; k < H; ++k) {
+                __m256 w0 = _mm256_loadu_ps(w + (size_t)k * G + j);
+                __m256 w1 = _mm256_loadu_ps(w + (size_t)k * G + j + 8);
+                for (int r = 0; r < R; ++r) {
+                    __m256 hk = _mm256_broadcast_ss(h + r * H + k);
+                    a[r][0] = _mm256_fmadd_ps(hk, w0, a[r][0]);
+                    a[r][1] = _mm256_fmadd_ps(hk, w1, a[r][1]);
+                }
+            }
+            for (int r = 0; r < R; ++r) {
+                _mm256_storeu_ps(acc + r * G + j, a[r][0]);
+                _mm256_storeu_ps(acc + r * G + j + 8, a[r][1]);
+            }
+        }
+
+        for (int r = 0; r < R; ++r) {
+            lstm_cell_avx2(acc + r * G, c + r * H, h + r * H, out + ((size_t)r * T + t) * H, H);
+        }
+    }
+}
+
+// int16 pairs of h(t-1) against pair interleaved weights with vpmaddwd
+template <int R>
+SIMD_AVX2 static void lstm_rows_int8_avx2(const float *gates,
+                                          const cpu_lstm_int8_t *w,
+                                          float *out,
+                                          int T,
+                                          bool reverse,
+                                          float *acc,
+                                          float *h,
+                                          float *c,
+                                          int16_t *hq) {
+    const int H = w->layer_size;
+    const int G = 4 * H;
+    const int16_t *w16 = w->w16.data();
+    const float *dequant = w->dequant.data();
+    for (int step = 0; step < T; ++step) {
+        int t = reverse ? T - 1 - step : step;
+
+        for (int j = 0; j < G; j += 16) {
+            __m256i a[R][2];
+            for (int r = 0; r < R; ++r) {
+                a[r][0] = _mm256_setzero_si256();
+                a[r][1] = _mm256_setzero_si256();
+            }
+            for (int k = 0; k < H; k += 2) {
+                const int16_t *wk = w16 + ((size_t)k * G + 2 * j);
+                __m256i w0 = _mm256_loadu_si256((const __m256i *)wk);
+                __m256i w1 = _mm256_loadu_si256((const __m256i *)(wk + 16));
+                for (int r = 0; r < R; ++r) {
+                    int32_t pair;
+                    memcpy(&pair, hq + r * H + k, sizeof(pair));
+                    __m256i hk = _mm256_set1_epi32(pair);
+                    a[r][0] = _mm256_add_epi32(a[r][0], _mm256_madd_epi16(hk, w0));
+                    a[r][1] = _mm256_add_epi32(a[r][1], _mm256_madd_epi16(hk, w1));
+                }
+            }
+            __m256 d0 = _mm256_loadu_ps(dequant + j);
+            __m256 d1 = _mm256_loadu_ps(dequant + j + 8);
+            for (int r = 0; r < R; ++r) {
+                const float *g = gates + ((size_t)r * T + t) * G + j;
+                _mm256_storeu_ps(acc + r * G + j,
+                                 _mm256_fmadd_ps(_mm256_cvtepi32_ps(a[r][0]), d0, _mm256_loadu_ps(g)));
+                _mm256_storeu_ps(acc + r * G + j + 8,
+                                 _mm256_fmadd_ps(_mm256_cvtepi32_ps(a[r][1]), d1, _mm256_loadu_ps(g + 8)));
+            }
+        }
+
+        for (int r = 0; r < R; ++r) {
+            lstm_cell_avx2(acc + r * G, c + r * H, h + r * H, out + ((size_t)r * T + t) * H, H);
+            for (int k = 0; k < H; ++k) {
+                hq[r * H + k] = (int16_t)lrintf(h[r * H + k] * H_SCALE);
+            }
+        }
+    }
+}
+
+/********************************** AVX-512 **********************************/
+
+// see lstm_cell_avx512()
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+template <int R>
+SIMD_AVX512 static void lstm_rows_avx512(const float *gates,
+                                         const float *w,
+                                         float *out,
+                                         int T,
+                                         int H,
+                                         bool reverse,
+                                         float *acc,
+                                         float *h,
+                                         float *c) {
+    const int G = 4 * H;
+    for (int step = 0; step < T; ++step) {
+        int t = reverse ? T - 1 - step : step;
+
+        for (int j = 0; j < G; j += 32) {
+            __m512 a[R][2];
+            for (int r = 0; r < R; ++r) {
+                const float *g = gates + ((size_t)r * T + t) * G + j;
+                a[r][0] = _mm512_loadu_ps(g);
+                a[r][1] = _mm512_loadu_ps(g + 16);
+            }
+            for (int k = 0; k < H; ++k) {
+                __m512 w0 = _mm512_loadu_ps(w + (size_t)k * G + j);
+                __m512 w1 = _mm512_loadu_ps(w + (size_t)k * G + j + 16);
+                for (int r = 0; r < R; ++r) {
+                    __m512 hk = _mm512_set1_ps(h[r * H + k]);
+                    a[r][0] = _mm512_fmadd_ps(hk, w0, a[r][0]);
+                    a[r][1] = _mm512_fmadd_ps(hk, w1, a[r][1]);
+                }
+            }
+            for (int r = 0; r < R; ++r) {
+                _mm512_storeu_ps(acc + r * G + j, a[r][0]);
+                _mm512_storeu_ps(acc + r * G + j + 16, a[r][1]);
+            }
+        }
+
+        for (int r = 0; r < R; ++r) {
+            lstm_cell_avx512(acc + r * G, c + r * H, h + r * H, out + ((size_t)r * T + t) * H, H);
+        }
+    }
+}
+
+// u8 quads of h(t-1) + 128 against quad interleaved int8 weights with vpdpbusd
+template <int R>
+SIMD_AVX512_VNNI static void lstm_rows_int8_vnni(const float *gates,
+                                                 const cpu_lstm_int8_t *w,
+                                                 float *out,
+                                                 int T,
+                                                 bool reverse,
+                                                 float *acc,
+                                                 float *h,
+                                                 float *c,
+                                                 uint8_t *hu) {
+    const int H = w->layer_size;
+    const int G = 4 * H;
+    const int8_t *w8 = w->w8.data();
+    const int32_t *w_sum = w->w_sum.data();
+    const float *dequant = w->dequant.data();
+    for (int step = 0; step < T; ++step) {
+        int t = reverse ? T - 1 - step : step;
+
+        for (int j = 0; j < G; j += 32) {
+            __m512i a[R][2];
+            for (int r = 0; r < R; ++r) {
+                a[r][0] = _mm512_setzero_si512();
+                a[r][1] = _mm512_setzero_si512();
+            }
+            for (int k = 0; k < H; k += 4) {
+                const int8_t *wk = w8 + ((size_t)k * G + 4 * j);
+                __m512i w0 = _mm512_loadu_si512((const void *)wk);
+                __m512i w1 = _mm512_loadu_si512((const void *)(wk + 64));
+                for (int r = 0; r < R; ++r) {
+                    int32_t quad;
+                    memcpy(&quad, hu + r * H + k, sizeof(quad));
+                    __m512i hk = _mm512_set1_epi32(quad);
+                    a[r][0] = _mm512_dpbusd_epi32(a[r][0], hk, w0);
+                    a[r][1] = _mm512_dpbusd_epi32(a[r][1], hk, w1);
+                }
+            }
+            __m512i s0 = _mm512_loadu_si512((const void *)(w_sum + j));
+            __m512i s1 = _mm512_loadu_si512((const void *)(w_sum + j + 16));
+            __m512 d0 = _mm512_loadu_ps(dequant + j);
+            __m512 d1 = _mm512_loadu_ps(dequant + j + 16);
+            for (int r = 0; r < R; ++r) {
+                const float *g = gates + ((size_t)r * T + t) * G + j;
+                __m512 v0 = _mm512_cvtepi32_ps(_mm512_sub_epi32(a[r][0], s0));
+                __m512 v1 = _mm512_cvtepi32_ps(_mm512_sub_epi32(a[r][1], s1));
+                _mm512_storeu_ps(acc + r * G + j, _mm512_fmadd_ps(v0, d0, _mm512_loadu_ps(g)));
+                _mm512_storeu_ps(acc + r * G + j + 16, _mm512_fmadd_ps(v1, d1, _mm512_loadu_ps(g + 16)));
+            }
+        }
+
+        for (int r = 0; r < R; ++r) {
+            lstm_cell_avx512(acc + r * G, c + r * H, h + r * H, out + ((size_t)r * T + t) * H, H);
+            for (int k = 0; k < H; ++k) {
+                hu[r * H + k] = (uint8_t)(lrintf(h[r * H + k] * H_SCALE) + 128);
+            }
+        }
+    }
+}
+#pragma GCC diagnostic pop
+
+/********************************* dispatch *********************************/
+
+enum lstm_isa { ISA_SCALAR, ISA_AVX2, ISA_AVX512, ISA_AVX512_VNNI };
+
+static const char *isa_name(lstm_isa isa) {
+    switch (isa) {
+    case ISA_AVX512_VNNI: return "avx512_vnni";
+    case ISA_AVX512: return "avx512";
+    case ISA_AVX2: return "avx2";
+    default: return "scalar";
+    }
+}
+
+// The cell loops step 16 (avx512) or 8 (avx2) hidden units at a time, which also keeps the
+// 32/16 wide gate column tiles and the 4/2 deep integer dot products inside the layer.
+static lstm_isa select_isa(int H) {
+    if (cpu_has_avx512() && H % 16 == 0) return ISA_AVX512;
+    if (cpu_has_avx2() && H % 8 == 0) return ISA_AVX2;
+    return ISA_SCALAR;
+}
+
+static lstm_isa select_int8_isa(int H) {
+    if (cpu_has_avx512_vnni() && H % 16 == 0) return ISA_AVX512_VNNI;
+    if (cpu_has_avx2() && H % 8 == 0) return ISA_AVX2;
+    return ISA_SCALAR;
+}
+
+bool cpu_lstm_supported(int layer_size) { return select_isa(layer_size) != ISA_SCALAR; }
+
+const char *cpu_lstm_isa() { return isa_name(select_isa(16)); }
+
+bool cpu_lstm_int8_supported(int layer_size) { return select_int8_isa(layer_size) != ISA_SCALAR; }
+
+const char *cpu_lstm_int8_isa() { return isa_name(select_int8_isa(16)); }
+
+template <int R>
+static void lstm_rows(lstm_isa isa,
+                      const float *gates,
+                      const float *w,
+                      float *out,
+                      int T,
+                      int H,
+                      bool reverse,
+                      float *acc,
+                      float *h,
+                      float *c) {
+    switch (isa) {
+    case ISA_AVX512:
+        lstm_rows_avx512<R>(gates, w, out, T, H, reverse, acc, h, c);
+        break;
+    case ISA_AVX2:
+        lstm_rows_avx2<R>(gates, w, out, T, H, reverse, acc, h, c);
+        break;
+    default:
+        lstm_rows_scalar<R>(gates, w, out, T, H, reverse, acc, h, c);
+    }
+}
+
+void cpu_lstm_layer(const float *gates,
+                    const float *w_hh_t,
+                    float *out,
+                    int T,
+                    int H,
+                    size_t row_start,
+                    size_t row_end,
+                    bool reverse) {
+    const int G = 4 * H;
+    lstm_isa isa = select_isa(H);
+
+    std::vector<float> acc(ROW_BLOCK * G);
+    std::vector<float> h(ROW_BLOCK * H);
+    std::vector<float> c(ROW_BLOCK * H);
+
+    for (size_t row = row_start; row < row_end; row += ROW_BLOCK) {
+        int rows = (int)std::min((size_t)ROW_BLOCK, row_end - row);
+        std::fill(h.begin(), h.end(), 0.0f);
+        std::fill(c.begin(), c.end(), 0.0f);
+
+        const float *g = gates + row * T * G;
+        float *o = out + row * T * H;
+        switch (rows) {
+        case 4: lstm_rows<4>(isa, g, w_hh_t, o, T, H, reverse, acc.data(), h.data(), c.data()); break;
+        case 3: lstm_rows<3>(isa, g, w_hh_t, o, T, H, reverse, acc.data(), h.data(), c.data()); break;
+        case 2: lstm_rows<2>(isa, g, w_hh_t, o, T, H, reverse, acc.data(), h.data(), c.data()); break;
+        default: lstm_rows<1>(isa, g, w_hh_t, o, T, H, reverse, acc.data(), h.data(), c.data()); break;
+        }
+    }
+}
+
+/*********************************** int8 ***********************************/
+
+void cpu_lstm_int8_pack(const int8_t *w_q, const float *scale, int H, cpu_lstm_int8_t *w) {
+    const int G = 4 * H;
+    w->layer_size = H;
+    w->isa = select_int8_isa(H);
+    w->dequant.resize(G);
+    for (int j = 0; j < G; ++j) {
+        w->dequant[j] = 1.0f / (H_SCALE * scale[j]);
+    }
+
+    if (w->isa == ISA_AVX512_VNNI) {
+        w->w8.resize((size_t)H * G);
+        w->w_sum.assign(G, 0);
+        for (int k = 0; k < H; ++k) {
+            for (int j = 0; j < G; ++j) {
+                int8_t v = w_q[(size_t)k * G + j];
+                w->w8[((size_t)(k / 4) * G + j) * 4 + k % 4] = v;
+                w->w_sum[j] += 128 * v;
+            }
+        }
+    } else {
+        w->w16.resize((size_t)H * G);
+        for (int k = 0; k < H; ++k) {
+            for (int j = 0; j < G; ++j) {
+                w->w16[((size_t)(k / 2) * G + j) * 2 + k % 2] = w_q[(size_t)k * G + j];
+            }
+        }
+    }
+}
+
+template <int R>
+static void lstm_rows_int8(const float *gates,
+                           const cpu_lstm_int8_t *w,
+                           float *out,
+                           int T,
+                           bool reverse,
+                           float *acc,
+                           float *h,
+                           float *c,
+                           void *hq) {
+    if (w->isa == ISA_AVX512_VNNI) {
+        lstm_rows_int8_vnni<R>(gates, w, out, T, reverse, acc, h, c, (uint8_t *)hq);
+    } else {
+        lstm_rows_int8_avx2<R>(gates, w, out, T, reverse, acc, h, c, (int16_t *)hq);
+    }
+}
+
+void cpu_lstm_layer_int8(const float *gates,
+                         const cpu_lstm_int8_t *w,
+                         float *out,
+                         int T,
+                         size_t row_start,
+                         size_t row_end,
+                         bool reverse) {
+    const int H = w->layer_size;
+    const int G = 4 * H;
+
+    std::vector<float> acc(ROW_BLOCK * G);
+    std::vector<float> h(ROW_BLOCK * H);
+    std::vector<float> c(ROW_BLOCK * H);
+    std::vector<int16_t> hq(ROW_BLOCK * H);  // int16 for avx2, (h_q + 128) as uint8 for vnni
+
+    for (size_t row = row_start; row < row_end; row += ROW_BLOCK) {
+        int rows = (int)std::min((size_t)ROW_BLOCK, row_end - row);
+        std::fill(h.begin(), h.end(), 0.0f);
+        std::fill(c.begin(), c.end(), 0.0f);
+        if (w->isa == ISA_AVX512_VNNI) {
+            memset(hq.data(), 128, ROW_BLOCK * H);
+        } else {
+            std::fill(hq.begin(), hq.end(), 0);
+        }
+
+        const float *g = gates + row * T * G;
+        float *o = out + row * T * H;
+        switch (rows) {
+        case 4: lstm_rows_int8<4>(g, w, o, T, reverse, acc.data(), h.data(), c.data(), hq.data()); break;
+        case 3: lstm_rows_int8<3>(g, w, o, T, reverse, acc.data(), h.data(), c.data(), hq.data()); break;
+        case 2: lstm_rows_int8<2>(g, w, o, T, reverse, acc.data(), h.data(), c.data(), hq.data()); break;
+        default: lstm_rows_int8<1>(g, w, o, T, reverse, acc.data(), h.data(), c.data(), hq.data()); break;
+        }
+    }
+}
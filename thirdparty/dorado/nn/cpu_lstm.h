@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+// Hand written recurrence for the CPU LSTM layers.
+//
+// The input projection x·W_ih^T + b_ih + b_hh of a whole layer is done up front as one GEMM by the
+// caller, so per timestep only h(t-1)·W_hh^T remains. The gate nonlinearities are fused into that
+// step and reverse layers walk time backwards in place, so no flipped copies of the activations
+// are made. Gate order is torch's i, f, g, o.
+
+// True if the vectorised kernels can run a layer of this size on this CPU.
+// (The v4 models use 96, 128 and 384.)
+bool cpu_lstm_supported(int layer_size);
+
+// Instruction set the kernels dispatch to, for the startup report.
+const char *cpu_lstm_isa();
+
+// Runs one layer for batch rows [row_start, row_end), starting from zero state.
+//  gates:  [N][T][4H] input projections including both biases
+//  w_hh_t: [H][4H] transposed recurrent weights
+//  out:    [N][T][H] hidden state at each timestep, in the original time order
+void cpu_lstm_layer(const float *gates,
+                    const float *w_hh_t,
+                    float *out,
+                    int T,
+                    int H,
+                    size_t row_start,
+                    size_t row_end,
+                    bool reverse);
+
+// Int8 recurrent weights, repacked for the integer dot product of the running CPU.
+// The hidden state is requantized every step with a fixed scale of 127 (|h| < 1), so
+// h(t-1)·W_hh^T ~= sum(h_q * w_q) * dequant[j].
+typedef struct {
+    int layer_size;
+    int isa;
+    std::vector<int8_t> w8;     // avx512 vnni: [H/4][4H][4]
+    std::vector<int16_t> w16;   // avx2: [H/2][4H][2]
+    std::vector<int32_t> w_sum; // 128 * column sums of w8, undoes the unsigned offset of h for vnni
+    std::vector<float> dequant; // 1 / (127 * scale[j])
+} cpu_lstm_int8_t;
+
+bool cpu_lstm_int8_supported(int layer_size);
+
+const char *cpu_lstm_int8_isa();
+
+// w_q: [H][4H] weights quantized per column, w ~= w_q / scale
+void cpu_lstm_int8_pack(const int8_t *w_q, const float *scale, int H, cpu_lstm_int8_t *w);
+
+// As cpu_lstm_layer(), with the recurrent matmul done in int8.
+void cpu_lstm_layer_int8(const float *gates,
+                         const cpu_lstm_int8_t *w,
+                         float *out,
+                         int T,
+                         size_t row_start,
+                         size_t row_end,
+                         bool reverse);
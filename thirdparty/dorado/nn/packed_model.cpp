@@ -0,0 +1,298 @@
+#include "packed_model.h"
+
+#include "../decode/fast_hash.h"
+#include "error.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <utility>
+
+#define PACKED_ALIGN 64
+#define PACKED_CHECKSUM_SEED 0x736c6f7261646f31ULL
+
+// The config is stored field by field, so the file does not depend on the layout of CRFModelConfig.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_tensors;
+    uint64_t file_size;
+    uint64_t data_checksum;     // of the tensor data, checked by pack-model --check
+    uint64_t table_checksum;    // of the header (with this field 0) and the tensor table, checked on load
+    float qscale, qbias, blank_score, scale;
+    int32_t conv, insize, stride, bias, clamp, decomposition, out_features, state_len, outsize,
+            num_features;
+    uint8_t reserved[32];
+} packed_header_t;
+
+typedef struct {
+    char name[64];
+    int32_t dtype; // PACKED_F32 or PACKED_I8
+    int32_t ndim;
+    int64_t shape[4];
+    uint64_t offset; // from the start of the file
+    uint64_t nbytes;
+    uint64_t reserved;
+} packed_tensor_t;
+
+static_assert(sizeof(packed_header_t) == 128, "packed model header must stay 128 bytes");
+static_assert(sizeof(packed_tensor_t) == 128, "packed model tensor entry must stay 128 bytes");
+
+enum { PACKED_F32 = 0, PACKED_I8 = 1 };
+
+static const char *lstm_fields[] = {"w_ih_t", "w_hh_t", "bias", "w_hh_q", "w_hh_scale"};
+
+// the parameters of each LSTM layer in the order prepare_cpu_lstm_weights() takes them
+static const char *lstm_params[] = {".rnn.weight_ih_", ".rnn.weight_hh_", ".rnn.bias_ih_", ".rnn.bias_hh_"};
+
+static std::vector<torch::Tensor> *lstm_field(CPULSTMWeights &w, int field) {
+    std::vector<torch::Tensor> *fields[] = {&w.w_ih_t, &w.w_hh_t, &w.bias, &w.w_hh_q, &w.w_hh_scale};
+    return fields[field];
+}
+
+static uint64_t align_up(uint64_t x) { return (x + PACKED_ALIGN - 1) / PACKED_ALIGN * PACKED_ALIGN; }
+
+static uint64_t data_offset(uint32_t num_tensors) {
+    return align_up(sizeof(packed_header_t) + num_tensors * sizeof(packed_tensor_t));
+}
+
+static uint64_t table_checksum(const packed_header_t &header, const uint8_t *table) {
+    packed_header_t h = header;
+    h.table_checksum = 0;
+    uint64_t seed = fasthash64(&h, sizeof(h), PACKED_CHECKSUM_SEED);
+    return fasthash64(table, header.num_tensors * sizeof(packed_tensor_t), seed);
+}
+
+bool is_packed_model(const std::string &path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (fp == NULL) {
+        return false;
+    }
+    char magic[8];
+    bool packed = fread(magic, 1, sizeof(magic), fp) == sizeof(magic) &&
+                  memcmp(magic, PACKED_MODEL_MAGIC, sizeof(magic)) == 0;
+    fclose(fp);
+    return packed;
+}
+
+void pack_crf_model(const std::string &model_dir, const std::string &out_path) {
+    torch::NoGradGuard no_grad;
+    const CRFModelConfig config = load_crf_model_config(model_dir);
+    const auto names = crf_model_weight_names(config.decomposition, config.bias);
+    const auto weights = load_crf_model_weights(model_dir, config.decomposition, config.bias);
+
+    std::vector<std::pair<std::string, torch::Tensor>> tensors;
+    for (size_t i = 0; i < weights.size(); ++i) {
+        tensors.emplace_back(names[i], weights[i].to(torch::kFloat32).contiguous());
+    }
+    // the LSTM weights by name, the 4 parameters of each layer in turn
+    std::vector<torch::Tensor> lstm_weights;
+    for (const auto &tensor : tensors) {
+        if (tensor.first.find(".rnn.") == std::string::npos) {
+            continue;
+        }
+        if (tensor.first.find(lstm_params[lstm_weights.size() % 4]) == std::string::npos) {
+            ERROR("Cannot pack %s: LSTM weight %s is out of order", model_dir.c_str(),
+                  tensor.first.c_str());
+            exit(EXIT_FAILURE);
+        }
+        lstm_weights.push_back(tensor.second);
+    }
+    if (lstm_weights.empty() || lstm_weights.size() % 4 != 0) {
+        ERROR("Cannot pack %s: %zu LSTM weights found", model_dir.c_str(), lstm_weights.size());
+        exit(EXIT_FAILURE);
+    }
+    CPULSTMWeights lstm = prepare_cpu_lstm_weights(lstm_weights, true);
+    for (int f = 0; f < 5; ++f) {
+        const auto &layers = *lstm_field(lstm, f);
+        for (size_t l = 0; l < layers.size(); ++l) {
+            tensors.emplace_back("lstm." + std::to_string(l) + "." + lstm_fields[f], layers[l]);
+        }
+    }
+
+    std::vector<packed_tensor_t> table(tensors.size());
+    uint64_t offset = data_offset(table.size());
+    for (size_t i = 0; i < tensors.size(); ++i) {
+        const torch::Tensor &t = tensors[i].second;
+        packed_tensor_t *e = &table[i];
+        memset(e, 0, sizeof(*e));
+        if (tensors[i].first.size() >= sizeof(e->name) || t.dim() > 4) {
+            ERROR("Cannot pack tensor %s", tensors[i].first.c_str());
+            exit(EXIT_FAILURE);
+        }
+        strcpy(e->name, tensors[i].first.c_str());
+        e->dtype = t.scalar_type() == torch::kI8 ? PACKED_I8 : PACKED_F32;
+        e->ndim = t.dim();
+        for (int d = 0; d < t.dim(); ++d) {
+            e->shape[d] = t.size(d);
+        }
+        e->nbytes = t.numel() * t.element_size();
+        e->offset = offset;
+        offset = align_up(offset + e->nbytes);
+    }
+
+    std::vector<uint8_t> file(offset, 0);
+    packed_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PACKED_MODEL_MAGIC, sizeof(header.magic));
+    header.version = PACKED_MODEL_VERSION;
+    header.num_tensors = table.size();
+    header.file_size = file.size();
+    header.qscale = config.qscale;
+    header.qbias = config.qbias;
+    header.blank_score = config.blank_score;
+    header.scale = config.scale;
+    header.conv = config.conv;
+    header.insize = config.insize;
+    header.stride = config.stride;
+    header.bias = config.bias;
+    header.clamp = config.clamp;
+    header.decomposition = config.decomposition;
+    header.out_features = config.out_features;
+    header.state_len = config.state_len;
+    header.outsize = config.outsize;
+    header.num_features = config.num_features;
+
+    memcpy(file.data() + sizeof(header), table.data(), table.size() * sizeof(packed_tensor_t));
+    for (size_t i = 0; i < tensors.size(); ++i) {
+        memcpy(file.data() + table[i].offset, tensors[i].second.data_ptr(), table[i].nbytes);
+    }
+    const uint64_t data_start = data_offset(table.size());
+    header.data_checksum = fasthash64(file.data() + data_start, file.size() - data_start,
+                                      PACKED_CHECKSUM_SEED);
+    header.table_checksum = table_checksum(header, file.data() + sizeof(header));
+    memcpy(file.data(), &header, sizeof(header));
+
+    FILE *fp = fopen(out_path.c_str(), "wb");
+    if (fp == NULL) {
+        ERROR("Cannot open %s for writing", out_path.c_str());
+        exit(EXIT_FAILURE);
+    }
+    if (fwrite(file.data(), 1, file.size(), fp) != file.size() || fclose(fp) != 0) {
+        ERROR("Writing %s failed", out_path.c_str());
+        exit(EXIT_FAILURE);
+    }
+    VERBOSE("packed %zu tensors (%.1f MB) from %s into %s", tensors.size(), file.size() / 1e6,
+            model_dir.c_str(), out_path.c_str());
+}
+
+void copy_packed_model(PackedModel &model) {
+    for (torch::Tensor &t : model.state_dict) {
+        t = t.clone();
+    }
+    for (int f = 0; f < 5; ++f) {
+        for (torch::Tensor &t : *lstm_field(model.lstm_weights, f)) {
+            t = t.clone();
+        }
+    }
+}
+
+PackedModel map_packed_model(const std::string &path, bool check_data) {
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        ERROR("Cannot open packed model %s", path.c_str());
+        exit(EXIT_FAILURE);
+    }
+    const size_t size = st.st_size;
+    if (size < sizeof(packed_header_t)) {
+        ERROR("Packed model %s is truncated", path.c_str());
+        exit(EXIT_FAILURE);
+    }
+    // private, so nothing that writes to a weight in place can change the file
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        ERROR("Cannot map packed model %s", path.c_str());
+        exit(EXIT_FAILURE);
+    }
+    std::shared_ptr<void> mapping(addr, [size](void *p) { munmap(p, size); });
+    const uint8_t *base = (const uint8_t *)addr;
+
+    packed_header_t header;
+    memcpy(&header, base, sizeof(header));
+    if (memcmp(header.magic, PACKED_MODEL_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != PACKED_MODEL_VERSION) {
+        ERROR("%s is not a version %d packed model, pack it again with slorado pack-model",
+              path.c_str(), PACKED_MODEL_VERSION);
+        exit(EXIT_FAILURE);
+    }
+    // only the header and the table are read here, the weights are paged in when they are first used
+    if (header.file_size != size || data_offset(header.num_tensors) > size ||
+        table_checksum(header, base + sizeof(header)) != header.table_checksum) {
+        ERROR("Packed model %s is corrupted (size or checksum mismatch)", path.c_str());
+        exit(EXIT_FAILURE);
+    }
+    if (check_data) {
+        const uint64_t data_start = data_offset(header.num_tensors);
+        if (fasthash64(base + data_start, size - data_start, PACKED_CHECKSUM_SEED) !=
+            header.data_checksum) {
+            ERROR("Packed model %s is corrupted (weight checksum mismatch)", path.c_str());
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    PackedModel model;
+    CRFModelConfig &config = model.config;
+    config.qscale = header.qscale;
+    config.qbias = header.qbias;
+    config.blank_score = header.blank_score;
+    config.scale = header.scale;
+    config.conv = header.conv;
+    config.insize = header.insize;
+    config.stride = header.stride;
+    config.bias = header.bias;
+    config.clamp = header.clamp;
+    config.decomposition = header.decomposition;
+    config.out_features = header.out_features;
+    config.state_len = header.state_len;
+    config.outsize = header.outsize;
+    config.num_features = header.num_features;
+
+    const auto names = crf_model_weight_names(config.decomposition, config.bias);
+    const packed_tensor_t *table = (const packed_tensor_t *)(base + sizeof(header));
+    for (uint32_t i = 0; i < header.num_tensors; ++i) {
+        packed_tensor_t e;
+        memcpy(&e, &table[i], sizeof(e));
+        e.name[sizeof(e.name) - 1] = '\0';
+        if (e.offset % PACKED_ALIGN != 0 || e.offset + e.nbytes > size || e.ndim < 0 || e.ndim > 4) {
+            ERROR("Packed model %s has a bad entry for %s", path.c_str(), e.name);
+            exit(EXIT_FAILURE);
+        }
+        auto options = torch::TensorOptions().dtype(e.dtype == PACKED_I8 ? torch::kI8 : torch::kFloat32);
+        std::vector<int64_t> shape(e.shape, e.shape + e.ndim);
+        torch::Tensor t = torch::from_blob((void *)(base + e.offset), shape, [mapping](void *) {}, options);
+
+        int layer;
+        char field[32];
+        if (sscanf(e.name, "lstm.%d.%31s", &layer, field) == 2) {
+            for (int f = 0; f < 5; ++f) {
+                if (strcmp(field, lstm_fields[f]) == 0) {
+                    lstm_field(model.lstm_weights, f)->push_back(t);
+                }
+            }
+        } else {
+            if (model.state_dict.size() >= names.size() || names[model.state_dict.size()] != e.name) {
+                ERROR("Packed model %s: unexpected weight %s", path.c_str(), e.name);
+                exit(EXIT_FAILURE);
+            }
+            model.state_dict.push_back(t);
+        }
+    }
+    if (model.state_dict.size() != names.size()) {
+        ERROR("Packed model %s: %zu of %zu weights found", path.c_str(), model.state_dict.size(),
+              names.size());
+        exit(EXIT_FAILURE);
+    }
+
+    return model;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+// Packed models: the parsed config.toml, the weights in the CPU runtime dtype (fp32) and the CPU LSTM
+// weights in the kernel layout (including the int8 quantised W_hh) in one file, written by
+// `slorado pack-model`. The basecaller maps the file instead of parsing TOML and unpickling the
+// *.tensor files one by one, and the weights are used in place from the mapping.
+//
+// Layout: header | tensor table | tensor data, each tensor 64 byte aligned. The header and the table
+// have a fasthash64 checksum that is verified on every load. The tensor data has its own, verified
+// only on request (slorado pack-model --check), as hashing it would read the whole file at startup.
+
+#include "CRFModel.h"
+
+#include <torch/torch.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#define PACKED_MODEL_MAGIC "SLORADOM"
+#define PACKED_MODEL_VERSION 2
+
+struct PackedModel {
+    CRFModelConfig config;
+    std::vector<torch::Tensor> state_dict; // in the order of crf_model_weight_names()
+    CPULSTMWeights lstm_weights;
+};
+
+// True if path is a file starting with the packed model magic (model directories are not).
+bool is_packed_model(const std::string &path);
+
+// Packs the model directory model_dir into out_path.
+void pack_crf_model(const std::string &model_dir, const std::string &out_path);
+
+// Maps a packed model (MAP_PRIVATE) and checks the checksum of its header and table, and with
+// check_data that of the weights. The tensors point into the mapping, which stays until the last of
+// them is freed.
+PackedModel map_packed_model(const std::string &path, bool check_data = false);
+
+// Replaces the tensors that point into the mapping with copies owned by the calling thread's node.
+void copy_packed_model(PackedModel &model);
@@ -1,8 +1,13 @@
 
 #include <cstdint>
 #include <stdlib.h>
+#include <algorithm>
 #include <vector>
 
+#include <c10/util/Half.h>
+
+#include "utils/simd.h"
+
 #include "signal_prep.h"
 
 #define EPS 1e-9f;
@@ -86,17 +91,41 @@ torch::Tensor tensor_from_record(slow5_rec_t *rec) {
 }
 
 std::vector<Chunk *> chunks_from_tensor(torch::Tensor &tensor, int chunk_size, int overlap) {
+    return chunks_from_signal(tensor.size(0), chunk_size, overlap);
+}
+
+std::vector<Chunk *> chunks_from_signal(size_t raw_size, int chunk_size, int overlap) {
+    return chunks_from_signal(raw_size, &chunk_size, 1, overlap);
+}
+
+static size_t smallest_bucket(size_t size, const int *bucket_size, int num_buckets) {
+    for (int b = 0; b < num_buckets - 1; ++b) {
+        if ((size_t)bucket_size[b] >= size) {
+            return bucket_size[b];
+        }
+    }
+    return bucket_size[num_buckets - 1];
+}
+
+std::vector<Chunk *> chunks_from_signal(size_t raw_size, const int *bucket_size, int num_buckets, int overlap) {
     std::vector<Chunk *> chunks;
 
-    size_t raw_size = tensor.size(0);
+    size_t chunk_size = bucket_size[num_buckets - 1];
     size_t offset = 0;
     size_t chunk_in_read_idx = 0;
     size_t signal_chunk_step = chunk_size - overlap;
-    chunks.push_back(new Chunk(offset, chunk_in_read_idx++, chunk_size));
+    chunks.push_back(new Chunk(offset, chunk_in_read_idx++, smallest_bucket(raw_size, bucket_size, num_buckets)));
 
     while (offset + chunk_size < raw_size) {
-        offset = std::min(offset + signal_chunk_step, raw_size - chunk_size);
-        chunks.push_back(new Chunk(offset, chunk_in_read_idx++, chunk_size));
+        offset += signal_chunk_step;
+        size_t remaining = raw_size - offset;
+        if (remaining > chunk_size) {
+            chunks.push_back(new Chunk(offset, chunk_in_read_idx++, chunk_size));
+        } else {
+            // the tail, aligned to the end of the read (it overlaps the previous chunk by at least overlap)
+            size_t tail_size = smallest_bucket(remaining, bucket_size, num_buckets);
+            chunks.push_back(new Chunk(raw_size - tail_size, chunk_in_read_idx++, tail_size));
+        }
     }
 
     return chunks;
@@ -133,4 +162,169 @@ std::vector<torch::Tensor> tensor_as_chunks(torch::Tensor &signal, std::vector<C
     }
 
     return tensors;
-}
\ No newline at end of file
+}
+
+static inline float normalise(int16_t x, float shift, float scale) {
+    return static_cast<float>(c10::Half(((float)x - shift) / scale));
+}
+
+/* Normalisation is monotonic in the raw value, so normalise(x) > threshold exactly when
+ * x >= the returned value. Returns 32768 if no int16 sample passes. */
+static int raw_threshold(float shift, float scale, float threshold) {
+    int lo = INT16_MIN;
+    int hi = INT16_MAX + 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (normalise((int16_t)mid, shift, scale) > threshold) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+SIMD_AVX2 static int count_at_least_avx2(const int16_t *p, int n, int16_t x_min) {
+    const __m256i below = _mm256_set1_epi16(x_min - 1);
+    int count = 0;
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        count += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpgt_epi16(v, below)));
+    }
+    count /= 2;  // two mask bits per 16-bit lane
+    for (; i < n; ++i) {
+        count += p[i] >= x_min;
+    }
+    return count;
+}
+
+static int count_at_least(const int16_t *p, int n, int x_min) {
+    if (x_min <= INT16_MIN) {
+        return n;
+    }
+    if (x_min > INT16_MAX) {
+        return 0;
+    }
+    if (cpu_has_avx2()) {
+        return count_at_least_avx2(p, n, (int16_t)x_min);
+    }
+    int count = 0;
+    for (int i = 0; i < n; ++i) {
+        count += p[i] >= x_min;
+    }
+    return count;
+}
+
+/* trim() on the raw samples: each window is a vectorised count against the raw threshold */
+static int trim_raw(const int16_t *raw,
+                    int size,
+                    float shift,
+                    float scale,
+                    int window_size,
+                    float threshold = 2.4,
+                    int min_elements = 3,
+                    int max_samples = 8000,
+                    float max_trim = 0.3) {
+    int min_trim = 10;
+    bool seen_peak = false;
+    int num_samples = std::min(max_samples, size - min_trim);
+    int num_windows = window_size > 0 ? num_samples / window_size : 0;
+    int x_min = raw_threshold(shift, scale, threshold);
+
+    for (int pos = 0; pos < num_windows; pos++) {
+        int start = pos * window_size + min_trim;
+        int end = start + window_size;
+
+        if ((count_at_least(raw + start, window_size, x_min) > min_elements) || seen_peak) {
+            seen_peak = true;
+            if (raw[end - 1] >= x_min) {
+                continue;
+            }
+            if (end >= num_samples || end >= (max_trim * (int64_t)size)) {
+                return min_trim;
+            } else {
+                return end;
+            }
+        }
+    }
+
+    return min_trim;
+}
+
+read_signal_t read_signal_from_record(slow5_rec_t *rec) {
+    const int16_t *raw = rec->raw_signal;
+    size_t len = rec->len_raw_signal;
+
+    const float q[2] = {0.2f, 0.9f};
+    float quantiles[2];
+    quantile_counting(raw, len, q, quantiles, 2);
+    float shift = std::max(10.0f, 0.51f * (quantiles[0] + quantiles[1]));
+    float scale = std::max(1.0f, 0.53f * (quantiles[1] - quantiles[0]));
+
+    // same float roundings as scale_signal()
+    float scaling = rec->range / rec->digitisation;
+    float offset = rec->offset;
+    float pa_scale = scaling * scale;
+    float pa_shift = scaling * (shift + offset);
+    float threshold = pa_shift + pa_scale * 2.4;
+
+    // scale_signal() hands the pA threshold to trim() as its window size, keep doing the same
+    int trim_start = trim_raw(raw, (int)std::min(len, (size_t)8000), shift, scale, (int)threshold);
+    trim_start = (int)std::min((size_t)trim_start, len);
+
+    read_signal_t signal;
+    signal.raw = raw + trim_start;
+    signal.len = len - trim_start;
+    signal.shift = shift;
+    signal.scale = scale;
+    return signal;
+}
+
+// Normalises n samples 8 at a time, the fp16 round trip done with F16C (round to nearest even
+// like c10::Half). Stores the fp16 bits when half is set, the rounded floats otherwise.
+SIMD_AVX2_F16C static size_t normalise_avx2(const int16_t *src, size_t n, float shift, float scale, void *dst, bool half) {
+    const __m256 shift_v = _mm256_set1_ps(shift);
+    const __m256 scale_v = _mm256_set1_ps(scale);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(src + i)));
+        __m256 y = _mm256_div_ps(_mm256_sub_ps(_mm256_cvtepi32_ps(x), shift_v), scale_v);
+        __m128i h = _mm256_cvtps_ph(y, _MM_FROUND_TO_NEAREST_INT);
+        if (half) {
+            _mm_storeu_si128((__m128i *)((uint16_t *)dst + i), h);
+        } else {
+            _mm256_storeu_ps((float *)dst + i, _mm256_cvtph_ps(h));
+        }
+    }
+    return i;
+}
+
+template <typename T>
+static void copy_chunk_impl(const read_signal_t &signal, size_t offset, size_t chunk_size, T *dst) {
+    size_t slice_size = offset < signal.len ? std::min(chunk_size, signal.len - offset) : 0;
+    if (slice_size == 0) {
+        std::fill(dst, dst + chunk_size, T(0.0f));
+        return;
+    }
+    const int16_t *src = signal.raw + offset;
+    size_t i = 0;
+    if (cpu_has_avx2_f16c()) {
+        i = normalise_avx2(src, slice_size, signal.shift, signal.scale, dst, sizeof(T) == 2);
+    }
+    for (; i < slice_size; ++i) {
+        dst[i] = T(normalise(src[i], signal.shift, signal.scale));
+    }
+    // repeat-pad a non-full chunk
+    for (size_t i = slice_size; i < chunk_size; ++i) {
+        dst[i] = dst[i - slice_size];
+    }
+}
+
+void copy_chunk(const read_signal_t &signal, size_t offset, size_t chunk_size, float *dst) {
+    copy_chunk_impl(signal, offset, chunk_size, dst);
+}
+
+void copy_chunk(const read_signal_t &signal, size_t offset, size_t chunk_size, c10::Half *dst) {
+    copy_chunk_impl(signal, offset, chunk_size, dst);
+}
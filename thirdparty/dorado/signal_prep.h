@@ -24,6 +24,29 @@ int trim(
 );
 void scale_signal(torch::Tensor &signal, float scaling, float offset);
 std::vector<Chunk *> chunks_from_tensor(torch::Tensor &tensor, int chunk_size, int overlap);
+std::vector<Chunk *> chunks_from_signal(size_t raw_size, int chunk_size, int overlap);
+/* As above with chunk length buckets in ascending order, the last one being the full chunk size.
+ * A read shorter than the full size, and the tail of a longer one, get the smallest bucket that
+ * covers them instead of being repeat-padded to the full size. */
+std::vector<Chunk *> chunks_from_signal(size_t raw_size, const int *bucket_size, int num_buckets, int overlap);
 std::vector<torch::Tensor> tensor_as_chunks(torch::Tensor &signal, std::vector<Chunk *> &chunks, size_t chunk_size);
 
+/* A read prepared for basecalling without materialising the scaled signal: the raw samples from
+ * the trim point on and the normalisation to apply to them. The samples stay owned by the record.
+ * Chunk offsets are relative to raw. */
+typedef struct {
+    const int16_t *raw;
+    size_t len;
+    float shift;
+    float scale;
+} read_signal_t;
+
+/* the single pass equivalent of tensor_from_record() + scale_signal() */
+read_signal_t read_signal_from_record(slow5_rec_t *rec);
+
+/* writes chunk_size normalised samples starting at offset to dst, repeat-padding a short tail
+ * the way tensor_as_chunks() does. Values are rounded through fp16 as in scale_signal(). */
+void copy_chunk(const read_signal_t &signal, size_t offset, size_t chunk_size, float *dst);
+void copy_chunk(const read_signal_t &signal, size_t offset, size_t chunk_size, c10::Half *dst);
+
 #endif
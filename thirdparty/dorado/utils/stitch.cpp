@@ -12,7 +12,7 @@ int div_round_closest(const int n, const int d)
     return ((n < 0) ^ (d < 0)) ? ((n - d/2)/d) : ((n + d/2)/d);
 }
 
-void stitch_chunks(std::vector<Chunk *> &chunks, std::string &sequence, std::string &qstring) {
+void stitch_chunks(std::vector<Chunk *> &chunks, std::string &sequence, std::string &qstring, bool with_qstring) {
     // Calculate the chunk down sampling, round to closest int.
     int down_sampling = div_round_closest(chunks[0]->raw_chunk_size, chunks[0]->moves.size());
 
@@ -37,7 +37,9 @@ void stitch_chunks(std::vector<Chunk *> &chunks, std::string &sequence, std::str
         int end_pos = current_chunk_seq_len - current_chunk_bases_to_trim;
         int trimmed_len = end_pos - start_pos;
         sequences.push_back(current_chunk.seq.substr(start_pos, trimmed_len));
-        qstrings.push_back(current_chunk.qstring.substr(start_pos, trimmed_len));
+        if (with_qstring) {
+            qstrings.push_back(current_chunk.qstring.substr(start_pos, trimmed_len));
+        }
 
         start_pos = 0;
         for (int i=0; i < mid_point; i++){
@@ -47,7 +49,9 @@ void stitch_chunks(std::vector<Chunk *> &chunks, std::string &sequence, std::str
 
     //append the final read
     sequences.push_back(chunks[chunks.size() - 1]->seq.substr(start_pos));
-    qstrings.push_back(chunks[chunks.size() - 1]->qstring.substr(start_pos));
+    if (with_qstring) {
+        qstrings.push_back(chunks[chunks.size() - 1]->qstring.substr(start_pos));
+    }
 
     // Set the read seq and qstring
     sequence = std::accumulate(sequences.begin(), sequences.end(), std::string(""));
@@ -4,4 +4,5 @@
 #include <vector>
 
 // Given a read with unstitched chunks, stitch the chunks (accounting for overlap) and assign basecalled read and qstring to Read
-void stitch_chunks(std::vector<Chunk *> &chunks, std::string &sequence, std::string &qstring);
+// Without with_qstring (FASTA output, the chunks have no qstrings) only the sequence is stitched.
+void stitch_chunks(std::vector<Chunk *> &chunks, std::string &sequence, std::string &qstring, bool with_qstring = true);
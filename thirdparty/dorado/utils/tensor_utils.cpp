@@ -3,6 +3,9 @@
 #include <torch/csrc/jit/serialization/pickle.h>
 #include "torch/torch.h"
 #include "error.h"
+#include "simd.h"
+
+#include <algorithm>
 
 namespace fs = std::experimental::filesystem;
 
@@ -53,30 +56,99 @@ torch::Tensor quantile(const torch::Tensor t, const torch::Tensor q) {
 torch::Tensor quantile_counting(const torch::Tensor t, const torch::Tensor q) {
     assert(q.dtype() == torch::kF32);
 
-    auto p = t.data_ptr<int16_t>();
-    auto range_min = t.min().item<int16_t>();
-    auto range_max = t.max().item<int16_t>();
+    auto tc = t.contiguous();
+    auto qc = q.contiguous();
+    auto res = torch::empty_like(qc);
+    quantile_counting(tc.data_ptr<int16_t>(), tc.size(0), qc.data_ptr<float>(), res.data_ptr<float>(),
+                      qc.numel());
+    return res;
+}
 
-    int size = t.size(0);
+SIMD_AVX2 static void minmax_avx2(const int16_t* p, size_t size, int16_t* range_min, int16_t* range_max) {
+    __m256i vmin = _mm256_set1_epi16(p[0]);
+    __m256i vmax = vmin;
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+        vmin = _mm256_min_epi16(vmin, v);
+        vmax = _mm256_max_epi16(vmax, v);
+    }
+    int16_t lane_min[16], lane_max[16];
+    _mm256_storeu_si256((__m256i*)lane_min, vmin);
+    _mm256_storeu_si256((__m256i*)lane_max, vmax);
+    int16_t mn = lane_min[0], mx = lane_max[0];
+    for (int k = 1; k < 16; ++k) {
+        mn = std::min(mn, lane_min[k]);
+        mx = std::max(mx, lane_max[k]);
+    }
+    for (; i < size; ++i) {
+        mn = std::min(mn, p[i]);
+        mx = std::max(mx, p[i]);
+    }
+    *range_min = mn;
+    *range_max = mx;
+}
+
+static void minmax_scalar(const int16_t* p, size_t size, int16_t* range_min, int16_t* range_max) {
+    int16_t mn = p[0], mx = p[0];
+    for (size_t i = 1; i < size; ++i) {
+        mn = std::min(mn, p[i]);
+        mx = std::max(mx, p[i]);
+    }
+    *range_min = mn;
+    *range_max = mx;
+}
 
-    std::vector<int> counts(range_max - range_min + 1, 0);
-    for (int i = 0; i < size; ++i) {
-        counts[p[i] - range_min]++;
+void quantile_counting(const int16_t* p, size_t size, const float* q, float* res, int n) {
+    if (size == 0) {
+        std::fill(res, res + n, 0.0f);
+        return;
     }
 
-    std::partial_sum(counts.begin(), counts.end(), counts.begin());
+    int16_t range_min, range_max;
+    if (cpu_has_avx2()) {
+        minmax_avx2(p, size, &range_min, &range_max);
+    } else {
+        minmax_scalar(p, size, &range_min, &range_max);
+    }
 
-    auto res = torch::empty_like(q);
+    // Four interleaved histograms, so consecutive equal samples (common in a flat signal) do not
+    // serialise on the same counter.
+    const size_t range = range_max - range_min + 1;
+    std::vector<int> counts(4 * range, 0);
+    int* c0 = counts.data();
+    int* c1 = c0 + range;
+    int* c2 = c1 + range;
+    int* c3 = c2 + range;
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+        c0[p[i] - range_min]++;
+        c1[p[i + 1] - range_min]++;
+        c2[p[i + 2] - range_min]++;
+        c3[p[i + 3] - range_min]++;
+    }
+    for (; i < size; ++i) {
+        c0[p[i] - range_min]++;
+    }
 
-    for (size_t idx = 0; idx < (size_t)q.numel(); idx++) {
-        int threshold = q[idx].item<float>() * (size - 1);
-        for (size_t i = 0; i <= counts.size(); ++i) {
-            if (counts[i] > threshold) {
-                res[idx] = (int16_t)i + range_min;
-                break;
-            }
+    // quantile k is the first value whose cumulative count exceeds q[k] * (size - 1)
+    std::vector<int> order(n);
+    std::vector<int> threshold(n);
+    for (int k = 0; k < n; ++k) {
+        order[k] = k;
+        threshold[k] = q[k] * (size - 1);
+    }
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return threshold[a] < threshold[b]; });
+
+    int cumulative = 0;
+    int k = 0;
+    for (size_t v = 0; v < range && k < n; ++v) {
+        cumulative += c0[v] + c1[v] + c2[v] + c3[v];
+        while (k < n && cumulative > threshold[order[k]]) {
+            res[order[k++]] = (int16_t)v + range_min;
         }
     }
-
-    return res;
+    for (; k < n; ++k) {
+        res[order[k]] = range_max;
+    }
 }
\ No newline at end of file
@@ -21,6 +21,11 @@ torch::Tensor quantile(const torch::Tensor t, const torch::Tensor q);
 // Only `interpolation='lower'` is currently implemented.
 torch::Tensor quantile_counting(const torch::Tensor t, const torch::Tensor q);
 
+// As above on a raw int16 array, writing the n quantiles q[i] to res[i].
+// One vectorised min/max pass and one histogram pass, with all quantiles read off in a single
+// walk over the cumulative counts.
+void quantile_counting(const int16_t* p, size_t size, const float* q, float* res, int n);
+
 // temporary
 inline void module_load_state_dict(torch::nn::Module& module,
                             const std::vector<torch::Tensor>& weights,